@@ -0,0 +1,885 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * bpemu - a Bus Pirate emulator on a pseudo terminal
+ *
+ * Speaks the terminal mode parts used by spitool (reset banner, "#", the
+ * "b" baud rate menu), the binary BBIO mode and the binary SPI mode, with
+ * a simulated M95xxx EEPROM or SPI NOR flash behind the SPI bus. Serial
+ * latency can be simulated per byte and per round trip, so changes to the
+ * transport can be measured without hardware:
+ *
+ *   bpemu -l /tmp/bp0 -r 2000 &
+ *   spitool -p /tmp/bp0 -d M95256 dump
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <popt.h>
+#include <sys/select.h>
+
+#include "buspirate.h"
+
+#define EMUBUFFER (2*TERMINAL_BUFFER+16)
+#define EMUSFDPSIZE 80        // SFDP header, one parameter header, 16 dwords of BFPT
+#define EMUUARTFIFO 4         // Hardware FIFOs of the PIC's UART
+
+enum EMUMODES {
+    EMTERMINAL,
+    EMBBIO,
+    EMSPI,
+    EMSNIFF
+};
+
+enum EMUMENUS {
+    EMNONE,
+    EMBAUD,                   // "b" menu, waiting for the rate selection
+    EMBRG,                    // Waiting for the raw BRG value
+    EMSPACE                   // Waiting for the space after a rate change
+};
+
+enum EMUMEMCMDS {
+    WRSR     = 0x01,
+    WRITE    = 0x02,
+    READ     = 0x03,
+    WRDI     = 0x04,
+    RDSR     = 0x05,
+    WREN     = 0x06,
+    /* SPI NOR flash only */
+    FASTREAD = 0x0b,
+    SE       = 0x20,
+    BE32     = 0x52,
+    RDSFDP   = 0x5a,
+    CE2      = 0x60,
+    RDID     = 0x9f,
+    EN4B     = 0xb7,
+    CE       = 0xc7,
+    BE64     = 0xd8,
+    EX4B     = 0xe9
+};
+
+enum EMUMEMSRFLAGS {
+    WIP      = 0x01,
+    WEL      = 0x02,
+    SRWRITABLE = 0x8c
+};
+
+typedef struct emu_mem_s {
+    uint8_t * data;
+    int capacity;
+    int pagesize;
+    int addresslength;
+    int twc;                  // Write cycle time in us, page program time for flash
+    int flash;                // SPI NOR flash: erase commands, programming only clears bits
+    uint8_t id [3];           // JEDEC ID
+    uint8_t sfdp [EMUSFDPSIZE]; // SFDP header and basic flash parameter table
+    int tse, tbe32, tbe64, tce; // Erase times in us
+    uint8_t sr;
+    long busy_until;
+    int selected;
+    int pos;                  // Byte position within the current CS frame
+    uint8_t command;
+    int addr;
+    uint8_t * page;           // Page latch for WRITE
+    uint8_t * dirty;
+    int latched;
+    uint8_t newsr;
+} emu_mem_t;
+
+typedef struct emu_state_s {
+    int fd;
+    int mode;
+    int menu;
+    int zeros;
+    char line [64];
+    int linelen;
+    int cspin;                // CS pin level
+    int csactivehigh;
+    int bytelatency;          // Simulated transfer time per byte in us
+    int rttlatency;           // Simulated latency per answer in us
+    uint8_t in [EMUBUFFER];
+    int inlen;
+    uint8_t out [EMUBUFFER];
+    int outlen;
+    int answering;            // Round trip latency already paid for the current answer
+    long sniffrate;           // Synthetic sniffer output in bytes/s, 0 for none
+    long sniffsent;           // Sniffer bytes owed since sniffing started
+    long sniffstart;
+    long sniffdropped;        // Lost to a full port, like the real one's buffer overflowing
+    int sniffaddr;
+    long bytesin, bytesout, answers, transactions;
+    long emitted;             // Answer bytes, flushed or not
+    int rxfifo;               // Input kept while answering, 0 for all
+    long rxdropped;
+    emu_mem_t mem;
+} emu_state_t;
+
+static volatile sig_atomic_t terminate;
+
+static void sighandler (int signum) {
+    terminate = 1;
+}
+
+static long now (void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Simulated M95xxx EEPROM */
+
+static void mem_update (emu_mem_t * mem) {
+    if (mem->sr & WIP && now () >= mem->busy_until)
+        mem->sr &= ~(WIP | WEL);
+}
+
+/* Like the real parts, WEL stays set until the write cycle is over */
+static void mem_busy (emu_mem_t * mem, int duration) {
+    mem->sr |= WIP;
+    mem->busy_until = now () + duration;
+}
+
+static void mem_erase (emu_mem_t * mem, int size, int duration) {
+    if (!mem->flash || !(mem->sr & WEL) || mem->pos != 1 + mem->addresslength)
+        return;
+    memset (mem->data + (mem->addr % mem->capacity & ~(size-1)), 0xff,
+            size < mem->capacity ? size : mem->capacity);
+    mem_busy (mem, duration);
+}
+
+static void mem_select (emu_mem_t * mem, int selected) {
+    int i;
+
+    if (selected == mem->selected)
+        return;
+    mem->selected = selected;
+    mem_update (mem);
+    if (selected) {
+        mem->pos = 0;
+        mem->latched = 0;
+        return;
+    }
+    /* Commands take effect when CS is deasserted */
+    if (!mem->pos || mem->sr & WIP)
+        return;
+    switch (mem->command) {
+    case WREN:
+        mem->sr |= WEL;
+        break;
+    case WRDI:
+        mem->sr &= ~WEL;
+        break;
+    case WRSR:
+        if (mem->sr & WEL && mem->pos == 2) {
+            mem->sr = (mem->sr & ~SRWRITABLE) | (mem->newsr & SRWRITABLE);
+            mem_busy (mem, mem->twc);
+        }
+        break;
+    case WRITE:
+        if (mem->sr & WEL && mem->latched) {
+            for (i=0; i<mem->pagesize; i++) {
+                uint8_t * cell = &mem->data[((mem->addr & ~(mem->pagesize-1)) + i) % mem->capacity];
+
+                if (mem->dirty[i])
+                    *cell = mem->flash ? *cell & mem->page[i] : mem->page[i];
+            }
+            mem_busy (mem, mem->twc);
+        }
+        break;
+    case SE:
+        mem_erase (mem, 4096, mem->tse);
+        break;
+    case BE32:
+        mem_erase (mem, 32768, mem->tbe32);
+        break;
+    case BE64:
+        mem_erase (mem, 65536, mem->tbe64);
+        break;
+    case CE:
+    case CE2:
+        if (mem->flash && mem->sr & WEL && mem->pos == 1) {
+            memset (mem->data, 0xff, mem->capacity);
+            mem_busy (mem, mem->tce);
+        }
+        break;
+    /* Parts beyond 16 MB power up with 3 address bytes */
+    case EN4B:
+    case EX4B:
+        if (mem->flash && mem->capacity > 16777216 && mem->pos == 1)
+            mem->addresslength = mem->command == EN4B ? 4 : 3;
+        break;
+    }
+}
+
+static uint8_t mem_xfer (emu_mem_t * mem, uint8_t mosi) {
+    int pos = mem->pos++;
+    uint8_t result = 0xff;
+
+    if (!mem->selected)
+        return 0xff;
+    mem_update (mem);
+    if (!pos) {
+        mem->command = mosi;
+        mem->addr = 0;
+        if (mem->command == WRITE) {
+            memset (mem->dirty, 0, mem->pagesize);
+            mem->latched = 0;
+        }
+        return 0xff;
+    }
+    /* Only the status register can be read during a write cycle */
+    if (mem->sr & WIP && mem->command != RDSR)
+        return 0xff;
+
+    switch (mem->command) {
+    case RDSR:
+        result = mem->sr;
+        break;
+    case WRSR:
+        if (pos == 1)
+            mem->newsr = mosi;
+        break;
+    case READ:
+    case FASTREAD:
+        if (pos <= mem->addresslength) {
+            mem->addr = (mem->addr << 8) | mosi;
+        } else if (mem->command == READ || !mem->flash || pos > mem->addresslength + 1) {
+            result = mem->data[mem->addr % mem->capacity];
+            mem->addr = (mem->addr + 1) % mem->capacity;
+        }
+        break;
+    case SE:
+    case BE32:
+    case BE64:
+        if (pos <= mem->addresslength)
+            mem->addr = (mem->addr << 8) | mosi;
+        break;
+    case RDID:
+        if (mem->flash && pos <= 3)
+            result = mem->id[pos-1];
+        break;
+    /* Always 3 address bytes and a dummy byte */
+    case RDSFDP:
+        if (pos <= 3) {
+            mem->addr = (mem->addr << 8) | mosi;
+        } else if (mem->flash && pos > 4) {
+            if (mem->addr < EMUSFDPSIZE)
+                result = mem->sfdp[mem->addr];
+            mem->addr++;
+        }
+        break;
+    case WRITE:
+        if (pos <= mem->addresslength) {
+            mem->addr = (mem->addr << 8) | mosi;
+        } else {
+            /* Writes wrap around within the page */
+            int offset = ((mem->addr % mem->pagesize) + pos - mem->addresslength - 1) % mem->pagesize;
+
+            mem->page[offset] = mosi;
+            mem->dirty[offset] = 1;
+            mem->latched = 1;
+        }
+        break;
+    }
+    return result;
+}
+
+/* Bus Pirate side */
+
+static void flush_out (emu_state_t * emu) {
+    int result, written = 0;
+
+    if (!emu->outlen)
+        return;
+    /* The round trip latency is paid once per answer, however long it gets */
+    if (!emu->answering) {
+        usleep (emu->rttlatency);
+        emu->answering = 1;
+        emu->answers++;
+    }
+    usleep (emu->outlen * emu->bytelatency);
+    while (written < emu->outlen) {
+        if ((result = write (emu->fd, emu->out + written, emu->outlen - written)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("write");
+            break;
+        }
+        written += result;
+    }
+    emu->bytesout += emu->outlen;
+    emu->outlen = 0;
+}
+
+static void emit (emu_state_t * emu, const void * data, int length) {
+    int l;
+
+    while (length) {
+        if (emu->outlen == sizeof (emu->out))
+            flush_out (emu);
+        l = sizeof (emu->out) - emu->outlen;
+        if (l > length)
+            l = length;
+        memcpy (emu->out + emu->outlen, data, l);
+        emu->outlen += l;
+        emu->emitted += l;
+        data = (const uint8_t *) data + l;
+        length -= l;
+    }
+}
+
+static void emits (emu_state_t * emu, const char * string) {
+    emit (emu, string, strlen (string));
+}
+
+static void emitc (emu_state_t * emu, uint8_t c) {
+    emit (emu, &c, 1);
+}
+
+static void set_cs (emu_state_t * emu, int level) {
+    emu->cspin = level;
+    mem_select (&emu->mem, level == emu->csactivehigh);
+}
+
+static void reset (emu_state_t * emu) {
+    set_cs (emu, 1);
+    emu->mode = EMTERMINAL;
+    emu->menu = EMNONE;
+    emu->zeros = 0;
+    emu->linelen = 0;
+    emits (emu, "\r\nBus Pirate v3.5\r\n"
+                "Firmware v6.2-beta1 r1981  Bootloader v4.4\r\n"
+                "DEVID:0x0447 REVID:0x3046 (24FJ64GA002 B8)\r\n"
+                "http://dangerousprototypes.com\r\n"
+                "HiZ>");
+}
+
+static void terminal_line (emu_state_t * emu) {
+    int value;
+
+    emu->line[emu->linelen] = 0;
+    emu->linelen = 0;
+    switch (emu->menu) {
+    case EMNONE:
+        if (!strcmp (emu->line, "b")) {
+            emits (emu, "Set serial port speed: (bps)\r\n"
+                        " 1. 300\r\n 2. 1200\r\n 3. 2400\r\n 4. 4800\r\n 5. 9600\r\n"
+                        " 6. 19200\r\n 7. 38400\r\n 8. 57600\r\n 9. 115200\r\n"
+                        "10. BRG raw value\r\n\r\n(9)>");
+            emu->menu = EMBAUD;
+        } else if (!strcmp (emu->line, "#")) {
+            reset (emu);
+        } else if (emu->line[0]) {
+            emits (emu, "Syntax error at char 1\r\nHiZ>");
+        } else {
+            emits (emu, "HiZ>");
+        }
+        break;
+    case EMBAUD:
+        value = atoi (emu->line);
+        if (value == 10) {
+            emits (emu, "Enter raw value for BRG\r\n\r\n(34)>");
+            emu->menu = EMBRG;
+        } else if (value >= 1 && value <= 9) {
+            emits (emu, "Adjust your terminal\r\nSpace to continue\r\n");
+            emu->menu = EMSPACE;
+        } else {
+            emits (emu, "\r\n(9)>");
+        }
+        break;
+    case EMBRG:
+        emits (emu, "Adjust your terminal\r\nSpace to continue\r\n");
+        emu->menu = EMSPACE;
+        break;
+    }
+}
+
+static void terminal_char (emu_state_t * emu, uint8_t c) {
+    if (!c) {
+        if (++emu->zeros == 20) {
+            emu->mode = EMBBIO;
+            emits (emu, "BBIO1");
+        }
+        return;
+    }
+    emu->zeros = 0;
+    if (emu->menu == EMSPACE) {
+        if (c == ' ') {
+            emits (emu, "\r\nHiZ>");
+            emu->menu = EMNONE;
+        }
+        return;
+    }
+    if (c == '\r' || c == '\n') {
+        emits (emu, "\r\n");
+        terminal_line (emu);
+    } else if (emu->linelen < sizeof (emu->line) - 1) {
+        emitc (emu, c);
+        emu->line[emu->linelen++] = c;
+    }
+}
+
+/* Handles the binary command at the start of buf, returns the number of bytes
+   consumed or 0 if the command is not complete yet */
+static int binary_command (emu_state_t * emu, uint8_t * buf, int len) {
+    int i, writelen, readlen;
+    uint8_t c = buf[0];
+
+    if (emu->mode == EMSNIFF) {
+        emu->mode = EMSPI;
+        return 1;
+    }
+    if (emu->mode == EMBBIO) {
+        switch (c) {
+        case BPBCENTER: emits (emu, "BBIO1"); break;
+        case BPBCENTERSPI: emits (emu, "SPI1"); emu->mode = EMSPI; break;
+        case BPBCRESET: emitc (emu, 1); reset (emu); break;
+        }
+        return 1;
+    }
+
+    switch (c) {
+    case BPSPIEXIT:
+        emits (emu, "BBIO1");
+        emu->mode = EMBBIO;
+        return 1;
+    case BPSPIENTER:
+        emits (emu, "SPI1");
+        return 1;
+    case BPSPICSLO:
+        set_cs (emu, 0);
+        emitc (emu, 1);
+        return 1;
+    case BPSPICSHI:
+        set_cs (emu, 1);
+        emitc (emu, 1);
+        return 1;
+    case BPSPIWRITEREADCS:
+    case BPSPIWRITEREADNOCS:
+        if (len < 5)
+            return 0;
+        writelen = buf[1] << 8 | buf[2];
+        readlen = buf[3] << 8 | buf[4];
+        if (writelen > TERMINAL_BUFFER || readlen > TERMINAL_BUFFER) {
+            emitc (emu, 0);
+            return 5;
+        }
+        if (len < 5 + writelen)
+            return 0;
+        emu->transactions++;
+        if (c == BPSPIWRITEREADCS)
+            set_cs (emu, 0);
+        for (i=0; i<writelen; i++)
+            mem_xfer (&emu->mem, buf[5+i]);
+        emitc (emu, 1);
+        for (i=0; i<readlen; i++)
+            emitc (emu, mem_xfer (&emu->mem, 0xff));
+        if (c == BPSPIWRITEREADCS)
+            set_cs (emu, 1);
+        return 5 + writelen;
+    case BPSPISNIFFALL:
+    case BPSPISNIFFCSLO:
+    case BPSPISNIFFCSHI:
+        emitc (emu, 1);
+        emu->mode = EMSNIFF;
+        emu->sniffstart = now ();
+        emu->sniffsent = 0;
+        return 1;
+    }
+
+    switch (c & 0xf0) {
+    case BPSPIWRITE:
+        if (len < 1 + (c & 0xf) + 1)
+            return 0;
+        emu->transactions++;
+        emitc (emu, 1);
+        for (i=0; i<(c & 0xf) + 1; i++)
+            emitc (emu, mem_xfer (&emu->mem, buf[1+i]));
+        return 1 + (c & 0xf) + 1;
+    case BPSPICONFIG1:
+        set_cs (emu, c & BPSPICFGCS);
+        emitc (emu, 1);
+        return 1;
+    case BPSPIREADAUX:
+    case BPSPISETSPEED:
+    case BPSPICONFIG2:
+        emitc (emu, 1);
+        return 1;
+    }
+
+    emitc (emu, 0);
+    return 1;
+}
+
+static void process (emu_state_t * emu) {
+    int pos = 0, result;
+    long emitted;
+
+    while (pos < emu->inlen) {
+        if (emu->mode == EMTERMINAL) {
+            terminal_char (emu, emu->in[pos++]);
+            continue;
+        }
+        emitted = emu->emitted;
+        if (!(result = binary_command (emu, emu->in + pos, emu->inlen - pos)))
+            break;
+        pos += result;
+        /* The firmware doesn't read its input while an answer longer than
+           the transmit FIFO goes out, the receive FIFO overruns instead */
+        if (emu->rxfifo && emu->emitted - emitted > EMUUARTFIFO && emu->inlen - pos > emu->rxfifo) {
+            emu->rxdropped += emu->inlen - pos - emu->rxfifo;
+            emu->inlen = pos + emu->rxfifo;
+        }
+    }
+    memmove (emu->in, emu->in + pos, emu->inlen - pos);
+    emu->inlen -= pos;
+}
+
+/* SFDP time fields: a 5 bit count - 1 of the smallest unit it fits in,
+   followed by the unit */
+static uint32_t sfdp_time (int us, const int * units, int nunits) {
+    int u, count;
+
+    for (u=0; u<nunits-1 && (us + units[u] - 1) / units[u] > 32; u++) ;
+    count = (us + units[u] - 1) / units[u];
+    count = count < 1 ? 1 : count > 32 ? 32 : count;
+    return (count - 1) | u << 5;
+}
+
+/* JESD216B basic flash parameter table describing the emulated flash */
+static void build_sfdp (emu_mem_t * mem) {
+    static const int erase_units [] = { 1000, 16000, 128000, 1000000 };
+    static const int chip_units [] = { 16000, 256000, 4000000, 64000000 };
+    static const int pp_units [] = { 8, 64 };
+    static const uint8_t header [16] = {
+        'S', 'F', 'D', 'P', 6, 1, 0, 0xff,      // Rev 1.6, one parameter header
+        0x00, 6, 1, 16, 16, 0, 0, 0xff          // BFPT rev 1.6, 16 dwords at 16
+    };
+    unsigned long long bits = mem->capacity * 8ULL;
+    uint32_t bfpt [16];
+    int i, shift;
+
+    memset (bfpt, 0, sizeof (bfpt));
+    /* 4k erase with 0x20, 3 or 4 address bytes beyond 16 MB */
+    bfpt[0] = 0x01 | SE << 8 | (mem->capacity > 16777216) << 17;
+    for (shift=0; bits > 1ULL << shift; shift++) ;
+    bfpt[1] = bits <= 0x80000000ULL ? bits - 1 : 0x80000000 | shift;
+    bfpt[7] = 12 | SE << 8 | 15 << 16 | BE32 << 24;
+    bfpt[8] = 16 | BE64 << 8;
+    bfpt[9] = 1 | sfdp_time (mem->tse, erase_units, 4) << 4 |
+              sfdp_time (mem->tbe32, erase_units, 4) << 11 |
+              sfdp_time (mem->tbe64, erase_units, 4) << 18;
+    for (shift=0; 1 << shift < mem->pagesize; shift++) ;
+    bfpt[10] = 1 | shift << 4 | sfdp_time (mem->twc, pp_units, 2) << 8 |
+               sfdp_time (mem->tce, chip_units, 4) << 24;
+
+    memcpy (mem->sfdp, header, sizeof (header));
+    for (i=0; i<64; i++)
+        mem->sfdp[16+i] = bfpt[i/4] >> (8 * (i%4));
+}
+
+static int load_image (emu_mem_t * mem, const char * filename) {
+    FILE * file;
+
+    if (!(file = fopen (filename, "r")))
+        return errno == ENOENT ? 0 : 1;
+    if (fread (mem->data, 1, mem->capacity, file) == 0 && ferror (file)) {
+        fclose (file);
+        return 1;
+    }
+    fclose (file);
+    return 0;
+}
+
+static int save_image (emu_mem_t * mem, const char * filename) {
+    FILE * file;
+
+    if (!(file = fopen (filename, "w")))
+        return 1;
+    fwrite (mem->data, 1, mem->capacity, file);
+    fclose (file);
+    return 0;
+}
+
+/* Sniffer output for a READ of 16 bytes, or every 16th frame a RDID */
+static int sniff_frame (emu_state_t * emu, uint8_t * frame) {
+    emu_mem_t * mem = &emu->mem;
+    uint8_t mosi [20], miso [20];
+    int i, n = 0, length;
+
+    memset (miso, 0xff, sizeof (miso));
+    if (!(emu->sniffaddr & 0xff)) {
+        mosi[0] = RDID;
+        memset (mosi+1, 0xff, 3);
+        memcpy (miso+1, mem->id, 3);
+        length = 4;
+    } else {
+        mosi[0] = READ;
+        for (i=0; i<mem->addresslength; i++)
+            mosi[1+i] = (emu->sniffaddr >> (8 * (mem->addresslength-1-i))) & 0xff;
+        for (i=0; i<16; i++) {
+            mosi[1+mem->addresslength+i] = 0xff;
+            miso[1+mem->addresslength+i] = mem->data[(emu->sniffaddr + i) % mem->capacity];
+        }
+        length = 1 + mem->addresslength + 16;
+    }
+    emu->sniffaddr = (emu->sniffaddr + 16) % mem->capacity;
+
+    frame[n++] = '[';
+    for (i=0; i<length; i++) {
+        frame[n++] = '\\';
+        frame[n++] = mosi[i];
+        frame[n++] = miso[i];
+    }
+    frame[n++] = ']';
+    return n;
+}
+
+/* Sends the frames due at sniffrate. Whatever the port doesn't take right
+   away is lost, as with the real one. */
+static void sniff_generate (emu_state_t * emu) {
+    uint8_t frame [2 + 3 * 20];
+    long due = (now () - emu->sniffstart) * emu->sniffrate / 1000000;
+    int flags, length, result;
+
+    flags = fcntl (emu->fd, F_GETFL);
+    fcntl (emu->fd, F_SETFL, flags | O_NONBLOCK);
+    while (emu->sniffsent < due) {
+        length = sniff_frame (emu, frame);
+        emu->sniffsent += length;
+        if ((result = write (emu->fd, frame, length)) == -1)
+            result = 0;
+        emu->bytesout += result;
+        emu->sniffdropped += length - result;
+    }
+    fcntl (emu->fd, F_SETFL, flags);
+}
+
+int main (int argc, const char ** argv) {
+    emu_state_t * emu;
+    struct termios tio;
+    struct sigaction sa;
+    const char * slavename;
+    char * linkname = NULL, * imagename = NULL;
+    int slavefd, result, c, intarg, id = 0xef4016;
+    fd_set set;
+    struct timeval tv;
+    poptContext optcon;
+    const struct poptOption cmdlineopts [] = {
+        { "ds", 0, POPT_ARG_INT, &intarg, 0x101,
+          "device size in bytes (default 32768/4194304)", "<integer>" },
+        { "ps", 0, POPT_ARG_INT, &intarg, 0x102,
+          "device page size in bytes (default 32/256)", "<integer>" },
+        { "as", 0, POPT_ARG_INT, &intarg, 0x100,
+          "device address length in bytes", "<integer>" },
+        { "twc", 'w', POPT_ARG_INT, &intarg, 'w',
+          "write cycle or page program time in us (default 5000/700)", "<integer>" },
+        { "bytelatency", 'b', POPT_ARG_INT, &intarg, 'b',
+          "transfer time per byte in us", "<integer>" },
+        { "rttlatency", 'r', POPT_ARG_INT, &intarg, 'r',
+          "latency per answer in us", "<integer>" },
+        { "activehigh", 'C', POPT_ARG_NONE, NULL, 'C',
+          "device CS is active high", NULL },
+        { "flash", 'F', POPT_ARG_NONE, NULL, 'F',
+          "emulate a SPI NOR flash instead of an EEPROM", NULL },
+        { "id", 0, POPT_ARG_INT, &intarg, 0x103,
+          "JEDEC ID of the flash (default 0xef4016)", "<integer>" },
+        { "tse", 0, POPT_ARG_INT, &intarg, 0x104,
+          "flash 4k sector erase time in us (default 45000)", "<integer>" },
+        { "tbe32", 0, POPT_ARG_INT, &intarg, 0x105,
+          "flash 32k block erase time in us (default 120000)", "<integer>" },
+        { "tbe64", 0, POPT_ARG_INT, &intarg, 0x106,
+          "flash 64k block erase time in us (default 150000)", "<integer>" },
+        { "tce", 0, POPT_ARG_INT, &intarg, 0x107,
+          "flash chip erase time in us (default 10000000)", "<integer>" },
+        { "rxfifo", 0, POPT_ARG_INT, &intarg, 0x109,
+          "input bytes kept while sending a long answer, 0 for all (default 4)", "<integer>" },
+        { "sniffrate", 0, POPT_ARG_INT, &intarg, 0x108,
+          "synthetic sniffer output in bytes/s", "<integer>" },
+        { "image", 'f', POPT_ARG_STRING, NULL, 'f',
+          "file to load the memory from and save it to on exit", "<string>" },
+        { "link", 'l', POPT_ARG_STRING, NULL, 'l',
+          "create a symlink to the pseudo terminal", "<string>" },
+        POPT_AUTOHELP
+        POPT_TABLEEND
+    };
+
+    if (!(emu = calloc (1, sizeof (emu_state_t))))
+        return 1;
+    emu->mem.capacity = 0;
+    emu->mem.pagesize = 0;
+    emu->mem.twc = -1;
+    emu->mem.tse = 45000;
+    emu->mem.tbe32 = 120000;
+    emu->mem.tbe64 = 150000;
+    emu->mem.tce = 10000000;
+    emu->rxfifo = EMUUARTFIFO;
+
+    optcon = poptGetContext (NULL, argc, argv, cmdlineopts, 0);
+    while ((c = poptGetNextOpt (optcon)) >= 0) {
+        switch (c) {
+        case 'b': emu->bytelatency = intarg; break;
+        case 'r': emu->rttlatency = intarg; break;
+        case 'w': emu->mem.twc = intarg; break;
+        case 'C': emu->csactivehigh = 1; break;
+        case 'F': emu->mem.flash = 1; break;
+        case 'f': imagename = poptGetOptArg (optcon); break;
+        case 'l': linkname = poptGetOptArg (optcon); break;
+        case 0x100: emu->mem.addresslength = intarg; break;
+        case 0x101: emu->mem.capacity = intarg; break;
+        case 0x102: emu->mem.pagesize = intarg; break;
+        case 0x103: id = intarg; break;
+        case 0x104: emu->mem.tse = intarg; break;
+        case 0x105: emu->mem.tbe32 = intarg; break;
+        case 0x106: emu->mem.tbe64 = intarg; break;
+        case 0x107: emu->mem.tce = intarg; break;
+        case 0x108: emu->sniffrate = intarg; break;
+        case 0x109: emu->rxfifo = intarg; break;
+        }
+    }
+    if (c < -1) {
+        poptPrintUsage (optcon, stderr, 0);
+        fprintf(stderr, "%s: %s\n",
+                poptBadOption(optcon, POPT_BADOPTION_NOALIAS),
+                poptStrerror(c));
+        return 1;
+    }
+    poptFreeContext (optcon);
+
+    /* Defaults are a M95256 EEPROM or a W25Q32 flash */
+    if (!emu->mem.capacity)
+        emu->mem.capacity = emu->mem.flash ? 4194304 : 32768;
+    if (!emu->mem.pagesize)
+        emu->mem.pagesize = emu->mem.flash ? 256 : 32;
+    if (emu->mem.twc < 0)
+        emu->mem.twc = emu->mem.flash ? 700 : 5000;
+    emu->mem.id[0] = (id >> 16) & 0xff;
+    emu->mem.id[1] = (id >> 8) & 0xff;
+    emu->mem.id[2] = id & 0xff;
+
+    if (emu->mem.capacity < 1 || emu->mem.pagesize < 1 ||
+        emu->mem.pagesize & (emu->mem.pagesize - 1)) {
+        fprintf (stderr, "Invalid device geometry.\n");
+        return 1;
+    }
+    if (!emu->mem.addresslength) {
+        if (emu->mem.capacity < 257) emu->mem.addresslength = 1;
+        else if (emu->mem.capacity < 65537) emu->mem.addresslength = 2;
+        else if (emu->mem.capacity <= 16777216 || emu->mem.flash) emu->mem.addresslength = 3;
+        else emu->mem.addresslength = 4;
+    }
+    build_sfdp (&emu->mem);
+    emu->mem.data = malloc (emu->mem.capacity);
+    emu->mem.page = malloc (emu->mem.pagesize);
+    emu->mem.dirty = malloc (emu->mem.pagesize);
+    if (!emu->mem.data || !emu->mem.page || !emu->mem.dirty)
+        return 1;
+    memset (emu->mem.data, 0xff, emu->mem.capacity);
+    if (imagename && load_image (&emu->mem, imagename)) {
+        fprintf (stderr, "Can't load image %s", imagename);
+        perror ("");
+        return 1;
+    }
+
+    if ((emu->fd = posix_openpt (O_RDWR | O_NOCTTY)) == -1 ||
+        grantpt (emu->fd) || unlockpt (emu->fd) ||
+        !(slavename = ptsname (emu->fd))) {
+        perror ("posix_openpt");
+        return 1;
+    }
+    /* Keep the slave open so the master survives clients closing the port */
+    if ((slavefd = open (slavename, O_RDWR | O_NOCTTY)) == -1) {
+        perror ("open");
+        return 1;
+    }
+    tcgetattr (slavefd, &tio);
+    cfmakeraw (&tio);
+    tcsetattr (slavefd, TCSANOW, &tio);
+
+    if (linkname) {
+        unlink (linkname);
+        if (symlink (slavename, linkname)) {
+            perror ("symlink");
+            return 1;
+        }
+    }
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = sighandler;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    emu->cspin = 1;
+    emu->mode = EMTERMINAL;
+    printf ("Emulated Bus Pirate on %s\n", linkname ? linkname : slavename);
+    fflush (stdout);
+
+    while (!terminate) {
+        FD_ZERO (&set);
+        FD_SET (emu->fd, &set);
+        tv.tv_sec = 0;
+        tv.tv_usec = emu->mode == EMSNIFF && emu->sniffrate ? 1000 : 100000;
+        result = select (emu->fd + 1, &set, NULL, NULL, &tv);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("select");
+            break;
+        }
+        if (emu->mode == EMSNIFF && emu->sniffrate)
+            sniff_generate (emu);
+        if (!result)
+            continue;
+        if ((result = read (emu->fd, emu->in + emu->inlen, sizeof (emu->in) - emu->inlen)) <= 0) {
+            if (result == -1 && errno == EINTR)
+                continue;
+            usleep (10000);
+            continue;
+        }
+        usleep (result * emu->bytelatency);
+        emu->bytesin += result;
+        emu->inlen += result;
+        process (emu);
+        flush_out (emu);
+        emu->answering = 0;
+    }
+
+    fprintf (stderr, "%ld bytes in, %ld bytes out, %ld answers, %ld SPI transactions, %ld bytes dropped\n",
+             emu->bytesin, emu->bytesout, emu->answers, emu->transactions, emu->rxdropped);
+    if (emu->sniffrate)
+        fprintf (stderr, "%ld sniffer bytes dropped\n", emu->sniffdropped);
+    if (imagename && save_image (&emu->mem, imagename)) {
+        fprintf (stderr, "Can't save image %s", imagename);
+        perror ("");
+    }
+    if (linkname)
+        unlink (linkname);
+    close (slavefd);
+    close (emu->fd);
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Event loop for many bus pirates on one thread.
+ *
+ * Every session is a coroutine with a stack of its own. Where the serial
+ * layer would select on the port, or the SPI layer sleep off a write
+ * cycle, the session arms its timerfd, adds the port to the epoll set for
+ * the time it waits for an answer, and switches back to the loop. The
+ * loop resumes it once the port is readable or the timer expired. So the
+ * protocol code stays as it is, and each session is suspended at whatever
+ * step it was.
+ *
+ * Outside a session, bp_wait_readable and bp_sleep simply block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/timerfd.h>
+
+#include "bploop.h"
+#include "bpstats.h"
+
+enum BPSESSIONSTATES {
+    BPSREADY,
+    BPSWAITING,
+    BPSDONE
+};
+
+typedef struct bp_fiber_s bp_fiber_t;
+
+/* What an epoll event is about: a session's timer or its port */
+typedef struct bp_source_s {
+    bp_fiber_t * fiber;
+    int timer;
+} bp_source_t;
+
+struct bp_fiber_s {
+    ucontext_t context;
+    void * stack;
+    bp_loop_t * loop;
+    bp_session_t session;
+    bp_session_done_t done;
+    void * ctx;
+    int state;
+    int result;
+    int timerfd;
+    int fd;                   // Port waited for, -1 while sleeping
+    int wake;                 // 1 if the port became readable, 0 on timeout
+    bp_source_t timersrc;
+    bp_source_t fdsrc;
+    bp_stats_t stats;         // Swapped with bp_stats while running
+    bp_fiber_t * next;
+};
+
+struct bp_loop_s {
+    int epfd;
+    ucontext_t main;
+    bp_fiber_t * fibers;
+    int live;
+};
+
+static bp_fiber_t * current;
+
+static void _bp_loop_start (void) {
+    bp_fiber_t * f = current;
+
+    f->result = f->session (f->ctx);
+    f->state = BPSDONE;
+    /* Returns to the loop through uc_link */
+}
+
+bp_loop_t * bp_loop_new (void) {
+    bp_loop_t * loop;
+
+    if (!(loop = calloc (1, sizeof (bp_loop_t))))
+        return NULL;
+    if ((loop->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1) {
+        perror ("epoll_create1");
+        free (loop);
+        return NULL;
+    }
+    return loop;
+}
+
+int bp_loop_add (bp_loop_t * loop, bp_session_t session, bp_session_done_t done, void * ctx) {
+    struct epoll_event ev;
+    bp_fiber_t * f;
+
+    if (!(f = calloc (1, sizeof (bp_fiber_t))) || !(f->stack = malloc (BPLOOPSTACK))) {
+        free (f);
+        return 1;
+    }
+    f->loop = loop;
+    f->session = session;
+    f->done = done;
+    f->ctx = ctx;
+    f->fd = -1;
+    f->timersrc.fiber = f->fdsrc.fiber = f;
+    f->timersrc.timer = 1;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &f->timersrc;
+    if ((f->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 ||
+        epoll_ctl (loop->epfd, EPOLL_CTL_ADD, f->timerfd, &ev)) {
+        perror ("timerfd");
+        if (f->timerfd != -1)
+            close (f->timerfd);
+        free (f->stack);
+        free (f);
+        return 1;
+    }
+
+    getcontext (&f->context);
+    f->context.uc_stack.ss_sp = f->stack;
+    f->context.uc_stack.ss_size = BPLOOPSTACK;
+    f->context.uc_link = &loop->main;
+    makecontext (&f->context, _bp_loop_start, 0);
+
+    f->next = loop->fibers;
+    loop->fibers = f;
+    loop->live++;
+    return 0;
+}
+
+static void _bp_loop_finish (bp_loop_t * loop, bp_fiber_t * f) {
+    bp_fiber_t ** p;
+
+    for (p=&loop->fibers; *p != f; p=&(*p)->next) ;
+    *p = f->next;
+    loop->live--;
+    close (f->timerfd);
+    if (f->done)
+        f->done (f->ctx, f->result);
+    free (f->stack);
+    free (f);
+}
+
+/* Runs the session until it waits or returns, with its own statistics */
+static void _bp_loop_resume (bp_loop_t * loop, bp_fiber_t * f) {
+    bp_stats_t saved = bp_stats;
+
+    bp_stats = f->stats;
+    current = f;
+    swapcontext (&loop->main, &f->context);
+    current = NULL;
+    f->stats = bp_stats;
+    bp_stats = saved;
+    if (f->state == BPSDONE)
+        _bp_loop_finish (loop, f);
+}
+
+/* Runs the sessions until all of them returned */
+int bp_loop_run (bp_loop_t * loop) {
+    struct epoll_event events [BPLOOPEVENTS];
+    bp_source_t * src;
+    bp_fiber_t * f, * next;
+    uint64_t expirations;
+    int i, n;
+
+    while (loop->live) {
+        for (f=loop->fibers; f; f=next) {
+            next = f->next;
+            if (f->state == BPSREADY)
+                _bp_loop_resume (loop, f);
+        }
+        if (!loop->live)
+            break;
+
+        if ((n = epoll_wait (loop->epfd, events, BPLOOPEVENTS, -1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("epoll_wait");
+            return 1;
+        }
+        for (i=0; i<n; i++) {
+            src = events[i].data.ptr;
+            f = src->fiber;
+            if (src->timer) {
+                if (read (f->timerfd, &expirations, sizeof (expirations)) != sizeof (expirations))
+                    continue;
+                if (f->state == BPSWAITING) {
+                    f->wake = 0;
+                    f->state = BPSREADY;
+                }
+            } else if (f->state == BPSWAITING && f->fd != -1) {
+                f->wake = 1;
+                f->state = BPSREADY;
+            }
+        }
+    }
+    return 0;
+}
+
+void bp_loop_free (bp_loop_t * loop) {
+    if (loop) {
+        close (loop->epfd);
+        free (loop);
+    }
+}
+
+/* Switches to the loop until the port (if any) is readable or timeout us
+   have passed */
+static int _bp_loop_yield (int fd, long timeout) {
+    bp_fiber_t * f = current;
+    struct itimerspec its;
+    struct epoll_event ev;
+
+    memset (&its, 0, sizeof (its));
+    /* A zero time would disarm the timer */
+    its.it_value.tv_sec = timeout / 1000000;
+    its.it_value.tv_nsec = timeout > 0 ? timeout % 1000000 * 1000 : 1;
+    if (timerfd_settime (f->timerfd, 0, &its, NULL)) {
+        perror ("timerfd_settime");
+        return -1;
+    }
+    /* The port is only in the set while waited for: once closed, its
+       number may be another session's port */
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &f->fdsrc;
+    if (fd != -1 && epoll_ctl (f->loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror ("epoll_ctl");
+        return -1;
+    }
+
+    f->fd = fd;
+    f->state = BPSWAITING;
+    swapcontext (&f->context, &f->loop->main);
+
+    if (fd != -1)
+        epoll_ctl (f->loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    /* Woken by the port, the timer mustn't wake the next wait */
+    if (f->wake) {
+        memset (&its, 0, sizeof (its));
+        timerfd_settime (f->timerfd, 0, &its, NULL);
+    }
+    f->fd = -1;
+    return f->wake;
+}
+
+/* Returns 1 once fd is readable, 0 after timeout us, -1 on errors */
+int bp_wait_readable (int fd, long timeout) {
+    fd_set set;
+    struct timeval tv;
+    int result;
+
+    if (current)
+        return _bp_loop_yield (fd, timeout);
+
+    FD_ZERO (&set);
+    FD_SET (fd, &set);
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+    if ((result = select (fd + 1, &set, NULL, NULL, &tv)) == -1)
+        perror ("select");
+    return result;
+}
+
+void bp_sleep (long us) {
+    if (current)
+        _bp_loop_yield (-1, us);
+    else
+        usleep (us);
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __BPLOOP_H__
+#define __BPLOOP_H__
+
+#define BPLOOPSTACK (256 * 1024) // Stack of a session
+#define BPLOOPEVENTS 64       // epoll events handled per wakeup
+
+/* A session runs the blocking bp_* calls of one bus pirate. Run on a
+   bp_loop, it yields to the loop wherever it would wait. */
+typedef int (*bp_session_t) (void * ctx);
+/* Called from the loop when a session has returned */
+typedef void (*bp_session_done_t) (void * ctx, int result);
+
+typedef struct bp_loop_s bp_loop_t;
+
+bp_loop_t * bp_loop_new (void);
+int bp_loop_add (bp_loop_t * loop, bp_session_t session, bp_session_done_t done, void * ctx);
+int bp_loop_run (bp_loop_t * loop);
+void bp_loop_free (bp_loop_t * loop);
+
+int bp_wait_readable (int fd, long timeout);
+void bp_sleep (long us);
+
+#endif
@@ -18,10 +18,18 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "serial.h"
 #include "buspirate.h"
+#include "bpstats.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#define BPSPIPOLLDEPTH 4
 
 int bp_spi_enter (bp_state_t * bp) {
     int result;
@@ -63,29 +71,24 @@ int bp_spi_enter (bp_state_t * bp) {
     return 0;
 }
 
-static int cs_control (bp_state_t * bp, int state) {
-    if (bp->flags & BPSPICFGOUTPUT) {
-        if (state) serWriteChar (bp->fd, bp->flags & BPSPICFGCS ? BPSPICSHI : BPSPICSLO);
-        else serWriteChar (bp->fd, bp->flags & BPSPICFGCS ? BPSPICSLO : BPSPICSHI);
-        if (serReadCharTimed (bp->fd, 1000000) != 1)
-            return 1;
-    } else {
-        if (state) serWriteChar (bp->fd, BPSPICONFIG1 | ((bp->flags & 0xf)));
-        else serWriteChar (bp->fd, BPSPICONFIG1 | ((bp->flags & 0xf) ^ BPSPICFGCS));
-        if (serReadCharTimed (bp->fd, 1000000) != 1)
-            return 1;
-        if (bp->flags & BPSPICFGAUXINPUT) {
-            serWriteChar (bp->fd, BPSPIREADAUX);
-            if (serReadCharTimed (bp->fd, 1000000) == -1)
-                return 1;
-        }
+/* Average time for a command and its answer, in us */
+long bp_spi_roundtrip (bp_state_t * bp, int count) {
+    uint8_t buffer [4];
+    long start = bp_stats_now ();
+    int i;
+
+    if (bp->mode != BPMBINARY || bp->submode != BPSMSPI || count <= 0)
+        return -1;
+    /* Repeating the mode entry just answers the version string */
+    for (i=0; i<count; i++) {
+        serWriteChar (bp->fd, BPSPIENTER);
+        if (serReadTimed (bp->fd, 1000000, 4, buffer) != 4)
+            return -1;
     }
-    return 0;
+    return (bp_stats_now () - start) / count;
 }
 
-int bp_spi_command (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer) {
-    int result = 0;
-
+static int spi_check (bp_state_t * bp, int writelen, int readlen) {
     if (writelen < 0 || writelen > TERMINAL_BUFFER ||
         readlen  < 0 || readlen  > TERMINAL_BUFFER)
         return 1;
@@ -93,34 +96,285 @@ int bp_spi_command (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer
         return 1;
     if (bp->bm_version != 1)
         return 2;
+    return 0;
+}
 
-    if (bp->flags & BPSPICFGCS || !(bp->flags & BPSPICFGOUTPUT)) {
-        if (cs_control (bp, 1))
-            return 3;
-        serWriteChar (bp->fd, BPSPIWRITEREADNOCS);
-    } else {
-        serWriteChar (bp->fd, BPSPIWRITEREADCS);
-    }
+/* Active high CS and Hi-Z outputs need CS to be switched by separate commands */
+static int spi_cs_separate (bp_state_t * bp) {
+    return bp->flags & BPSPICFGCS || !(bp->flags & BPSPICFGOUTPUT);
+}
 
-    serWriteChar (bp->fd, (writelen >> 8) & 0xff);
-    serWriteChar (bp->fd, writelen        & 0xff);
-    serWriteChar (bp->fd, (readlen >> 8)  & 0xff);
-    serWriteChar (bp->fd, readlen         & 0xff);
-/* Errors happen right after sending the length... check with a short timeout */
-    if ((result = serReadCharTimed (bp->fd, 10000)) != 0) {
-        if (writelen)
-            serWrite (bp->fd, writelen, buffer);
-        if (serReadCharTimed (bp->fd, 1000000) == 1 && readlen)
-            result = serReadTimed (bp->fd, 1000000, readlen, buffer);
+/* Stores the commands that switch CS to state and returns their number.
+   Hi-Z outputs switch CS through the pin configuration, which also turns
+   AUX into an output, so an input AUX is restored by reading it. */
+static int spi_cs_commands (bp_state_t * bp, int state, uint8_t * commands) {
+    if (bp->flags & BPSPICFGOUTPUT) {
+        commands[0] = !state == !(bp->flags & BPSPICFGCS) ? BPSPICSHI : BPSPICSLO;
+        return 1;
     }
+    commands[0] = BPSPICONFIG1 | ((bp->flags & 0xf) ^ (state ? 0 : BPSPICFGCS));
+    if (!(bp->flags & BPSPICFGAUXINPUT))
+        return 1;
+    commands[1] = BPSPIREADAUX;
+    return 2;
+}
 
-    if (bp->flags & BPSPICFGCS || !(bp->flags & BPSPICFGOUTPUT))
-        cs_control (bp, 0);
+/* Every CS command is acked with 0x01, but BPSPIREADAUX answers the AUX level */
+static int spi_receive_cs (bp_state_t * bp, int count) {
+    uint8_t answer [2];
 
-    if (result == readlen)
+    if (!count)
         return 0;
-    else
+    if (serReadTimed (bp->fd, 1000000, count, answer) != count || answer[0] != 1)
         return 3;
+    return 0;
+}
+
+/* The firmware only answers the header if it rejects the lengths, which are
+   checked before. Header and payload go out as one frame, the status byte
+   and the read data follow once the transaction is done. */
+static void spi_send (bp_state_t * bp, uint8_t command, int writelen, int readlen, uint8_t * buffer) {
+    uint8_t header [5];
+
+    header[0] = command;
+    header[1] = (writelen >> 8) & 0xff;
+    header[2] = writelen        & 0xff;
+    header[3] = (readlen >> 8)  & 0xff;
+    header[4] = readlen         & 0xff;
+    serWrite (bp->fd, sizeof (header), header);
+    if (writelen)
+        serWrite (bp->fd, writelen, buffer);
+}
+
+/* Short transactions fit a bulk transfer, which needs no 5 byte header */
+static void spi_send_bulk (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer) {
+    uint8_t frame [BPSPIBULKMAX + 1];
+    int length = writelen + readlen;
+
+    frame[0] = BPSPIWRITE | (length - 1);
+    memcpy (frame+1, buffer, writelen);
+    memset (frame+1+writelen, 0, readlen);
+    serWrite (bp->fd, length + 1, frame);
+}
+
+/* The ack for the bulk command, then the byte clocked in for each one sent */
+static int spi_receive_bulk (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer) {
+    uint8_t answer [BPSPIBULKMAX + 1];
+    int length = writelen + readlen + 1;
+
+    if (serReadTimed (bp->fd, 1000000, length, answer) != length || answer[0] != 1)
+        return 3;
+    memcpy (buffer, answer+1+writelen, readlen);
+    return 0;
+}
+
+static int spi_receive (bp_state_t * bp, int readlen, uint8_t * buffer) {
+    if (serReadCharTimed (bp->fd, 1000000) != 1)
+        return 3;
+    if (readlen && serReadTimed (bp->fd, 1000000, readlen, buffer) != readlen)
+        return 3;
+    return 0;
+}
+
+/* After a lost answer the byte stream can't be matched to the queue anymore.
+   Drop whatever still arrives and fail all transactions in flight. */
+static void spi_resync (bp_state_t * bp) {
+    uint8_t buffer [256];
+
+    while (serReadTimed (bp->fd, 10000, sizeof (buffer), buffer) > 0) ;
+    bp->rxseq = bp->txseq;
+}
+
+int bp_spi_command (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer) {
+    bp_spi_xfer_t xfer;
+
+    xfer.writelen = writelen;
+    xfer.readlen = readlen;
+    xfer.buffer = buffer;
+    if (bp_spi_submit (bp, &xfer))
+        return xfer.result;
+    return bp_spi_complete (bp, &xfer);
+}
+
+/* Everything a transaction needs goes out in one frame: the CS commands
+   if CS isn't switched by the transaction command itself, the transfer,
+   and the CS commands to release it again. Their acks are checked when
+   the transaction completes. */
+static int spi_submit (bp_state_t * bp, bp_spi_xfer_t * xfer, uint8_t command) {
+    uint8_t cs [2];
+    int length = xfer->writelen + xfer->readlen;
+
+    xfer->pending = 0;
+    xfer->frame = BPSPIFRAMEWRITEREAD;
+    xfer->cs = 0;
+    if ((xfer->result = spi_check (bp, xfer->writelen, xfer->readlen)))
+        return xfer->result;
+
+    /* The first byte sent with CS asserted is the opcode */
+    if (xfer->writelen && (command == BPSPIWRITEREADCS || bp->csopened))
+        bp_stats.opcode[xfer->buffer[0]]++;
+    bp->csopened = 0;
+
+    if (command == BPSPIWRITEREADCS) {
+        if (length > 0 && length <= BPSPIBULKMAX)
+            xfer->frame = BPSPIFRAMEBULK;
+        if (xfer->frame == BPSPIFRAMEBULK || spi_cs_separate (bp)) {
+            xfer->cs = spi_cs_commands (bp, 1, cs);
+            serWrite (bp->fd, xfer->cs, cs);
+            command = BPSPIWRITEREADNOCS;
+        }
+    }
+    if (xfer->frame == BPSPIFRAMEBULK)
+        spi_send_bulk (bp, xfer->writelen, xfer->readlen, xfer->buffer);
+    else
+        spi_send (bp, command, xfer->writelen, xfer->readlen, xfer->buffer);
+    if (xfer->cs) {
+        spi_cs_commands (bp, 0, cs);
+        serWrite (bp->fd, xfer->cs, cs);
+    }
+    xfer->seq = bp->txseq++;
+    xfer->pending = 1;
+    return 0;
+}
+
+int bp_spi_submit (bp_state_t * bp, bp_spi_xfer_t * xfer) {
+    return spi_submit (bp, xfer, BPSPIWRITEREADCS);
+}
+
+/* Like bp_spi_submit, but leaves CS alone, continuing the transaction
+   started by bp_spi_submit_cs */
+int bp_spi_submit_nocs (bp_state_t * bp, bp_spi_xfer_t * xfer) {
+    return spi_submit (bp, xfer, BPSPIWRITEREADNOCS);
+}
+
+/* Queues asserting (state 1) or releasing CS. The commands' answers are
+   collected by bp_spi_complete like any transaction. */
+int bp_spi_submit_cs (bp_state_t * bp, bp_spi_xfer_t * xfer, int state) {
+    uint8_t cs [2];
+
+    xfer->pending = 0;
+    xfer->frame = BPSPIFRAMECS;
+    xfer->writelen = xfer->readlen = 0;
+    if ((xfer->result = spi_check (bp, 0, 0)))
+        return xfer->result;
+
+    xfer->cs = spi_cs_commands (bp, state, cs);
+    serWrite (bp->fd, xfer->cs, cs);
+    bp->csopened = state;
+    xfer->seq = bp->txseq++;
+    xfer->pending = 1;
+    return 0;
+}
+
+int bp_spi_complete (bp_state_t * bp, bp_spi_xfer_t * xfer) {
+    if (!xfer->pending)
+        return xfer->result;
+    xfer->pending = 0;
+
+    /* Lost in a resync, or completed out of order */
+    if ((int)(xfer->seq - bp->rxseq) < 0)
+        return xfer->result = 3;
+    if (xfer->seq != bp->rxseq)
+        return xfer->result = 1;
+
+    xfer->result = spi_receive_cs (bp, xfer->cs);
+    if (!xfer->result && xfer->frame != BPSPIFRAMECS) {
+        if (xfer->frame == BPSPIFRAMEBULK)
+            xfer->result = spi_receive_bulk (bp, xfer->writelen, xfer->readlen, xfer->buffer);
+        else
+            xfer->result = spi_receive (bp, xfer->readlen, xfer->buffer);
+        if (!xfer->result)
+            xfer->result = spi_receive_cs (bp, xfer->cs);
+    }
+    if (xfer->result)
+        spi_resync (bp);
+    else
+        bp->rxseq++;
+    return xfer->result;
+}
+
+/* The firmware stops reading its serial port only while an answer doesn't
+   fit into the transmit FIFO, and then for about as many byte times as
+   there are bytes to go. Input sent behind answers of at most BPUARTFIFO
+   bytes thus fits into the receive FIFO. */
+static int spi_answer_short (const bp_spi_xfer_t * xfer) {
+    int length = xfer->readlen + 1;
+
+    if (xfer->frame == BPSPIFRAMEBULK)
+        length += xfer->writelen;
+    return length <= BPUARTFIFO;
+}
+
+/* Sends up to bp->depth transactions ahead of their answers, and any
+   number behind transactions with short answers, such as WREN and RDSR
+   before a write, so these go out as one transmission regardless of -Q */
+int bp_spi_queue (bp_state_t * bp, int count, bp_spi_xfer_t * xfers) {
+    int depth = bp->depth > 0 ? bp->depth : 1;
+    int submitted = 0, completed = 0, result = 0, longanswer = 0;
+
+    while (completed < count) {
+        while (!result && submitted < count &&
+               (submitted - completed < depth || completed >= longanswer)) {
+            result = bp_spi_submit (bp, &xfers[submitted++]);
+            if (!spi_answer_short (&xfers[submitted-1]))
+                longanswer = submitted;
+        }
+        if (completed == submitted)
+            break;
+        if (bp_spi_complete (bp, &xfers[completed++]) && !result)
+            result = xfers[completed-1].result;
+    }
+    for (; submitted < count; submitted++) {
+        xfers[submitted].pending = 0;
+        xfers[submitted].result = result;
+    }
+
+    return result;
+}
+
+/* Reads the status register with command until the bits in mask are
+   clear. With -Q, up to bp->depth probes are in flight, so the samples are
+   spaced by the transfer time of a probe rather than the USB round trip;
+   by default each probe is a round trip of its own. At most four are in
+   flight, as the ones sent after the status cleared still have to be
+   collected. Returns the first status with the mask bits clear, else
+   the last one read after probes tries, or -1 on errors. The time the
+   probe with the returned status was sent is stored in sent. */
+int bp_spi_poll (bp_state_t * bp, uint8_t command, uint8_t mask, int probes, long * sent) {
+    int depth = MIN(bp->depth > 0 ? bp->depth : 1, BPSPIPOLLDEPTH);
+    int submitted = 0, completed = 0, status = -1, done = 0, result = 0;
+    bp_spi_xfer_t xfer [BPSPIPOLLDEPTH];
+    uint8_t buffer [BPSPIPOLLDEPTH];
+    long times [BPSPIPOLLDEPTH];
+
+    while (1) {
+        while (!result && !done && submitted < probes && submitted - completed < depth) {
+            bp_spi_xfer_t * x = &xfer[submitted % depth];
+
+            buffer[submitted % depth] = command;
+            x->writelen = 1;
+            x->readlen = 1;
+            x->buffer = &buffer[submitted % depth];
+            times[submitted % depth] = bp_stats_now ();
+            if (bp_spi_submit (bp, x))
+                result = -1;
+            submitted++;
+            bp_stats.probes++;
+        }
+        if (completed == submitted)
+            break;
+        /* Probes already sent are collected after the status cleared */
+        if (bp_spi_complete (bp, &xfer[completed % depth])) {
+            result = -1;
+        } else if (!done) {
+            status = buffer[completed % depth];
+            *sent = times[completed % depth];
+            done = !(status & mask);
+        }
+        completed++;
+    }
+
+    return result ? -1 : status;
 }
 
 int bp_spi_command_short (bp_state_t * bp, int flags, uint8_t command, uint8_t data) {
@@ -134,9 +388,104 @@ int bp_spi_command_short (bp_state_t * bp, int flags, uint8_t command, uint8_t d
     buffer[1] = data;
 
     result = bp_spi_command (bp, flags&1 ? 2 : 1, flags&2 ? 1 : 0, buffer);
-    if (result == -1)
+    if (result)
         return -1;
     if (flags & 2)
         return buffer[0];
     return 0;
 }
+
+/* Stores addr MSB first in addrbytes bytes */
+int bp_spi_address (uint8_t * buffer, uint32_t addr, int addrbytes) {
+    int i;
+
+    for (i=0; i<addrbytes; i++)
+        buffer[i] = (addr >> (8 * (addrbytes-i-1))) & 0xff;
+    return addrbytes;
+}
+
+/* Reads length bytes in TERMINAL_BUFFER sized chunks with the given read
+   opcode and number of dummy bytes, keeping up to bp->depth transactions
+   in flight, and hands each chunk to consumer in order. The chunks after
+   it are already on the wire while the consumer runs.
+   Memories continue a read across the whole array while CS stays
+   asserted, so CS is asserted once, only the first chunk carries opcode
+   and address, and the rest are plain reads without CS changes. */
+int bp_spi_read_memory (bp_state_t * bp, uint8_t opcode, int dummy, uint32_t addr, uint32_t length,
+                        int addrbytes, bp_spi_chunk_t consumer, void * ctx) {
+    int depth = bp->depth > 0 ? bp->depth : 1;
+    int slots = depth + 1;    // One more buffer for the chunk being consumed
+    int chunks = length / TERMINAL_BUFFER + (length % TERMINAL_BUFFER ? 1 : 0);
+    int submitted = 0, completed = 0, ready = -1, result = 0;
+    uint32_t offset;
+    bp_spi_xfer_t * xfer, cs;
+    uint8_t * lbuf;
+
+    lbuf = malloc (slots * TERMINAL_BUFFER);
+    xfer = calloc (slots, sizeof (bp_spi_xfer_t));
+    if (!lbuf || !xfer) {
+        free (lbuf);
+        free (xfer);
+        return -1;
+    }
+
+    if (bp_spi_submit_cs (bp, &cs, 1))
+        result = -1;
+
+    while (1) {
+        while (!result && submitted < chunks && submitted - completed < depth) {
+            bp_spi_xfer_t * x = &xfer[submitted % slots];
+
+            offset = (uint32_t) submitted * TERMINAL_BUFFER;
+            x->buffer = lbuf + (submitted % slots) * TERMINAL_BUFFER;
+            x->readlen = MIN(length-offset, TERMINAL_BUFFER);
+            if (submitted) {
+                x->writelen = 0;
+            } else {
+                x->writelen = addrbytes+dummy+1;
+                x->buffer[0] = opcode;
+                bp_spi_address (x->buffer+1, addr, addrbytes);
+                memset (x->buffer+addrbytes+1, 0, dummy);
+            }
+            if (bp_spi_submit_nocs (bp, x))
+                result = -1;
+            submitted++;
+        }
+        if (ready >= 0) {
+            serFlush (bp->fd);
+            if (!result)
+                result = consumer (ctx, (uint32_t) ready * TERMINAL_BUFFER, xfer[ready % slots].readlen,
+                                   xfer[ready % slots].buffer);
+            ready = -1;
+        }
+        if (bp_spi_complete (bp, &cs) && !result)
+            result = -1;
+        if (completed == submitted)
+            break;
+        /* Answers in flight are collected even after a failure to keep the queue in sync */
+        if (bp_spi_complete (bp, &xfer[completed % slots])) {
+            if (!result)
+                result = -1;
+        } else {
+            ready = completed;
+        }
+        completed++;
+    }
+
+    /* CS is released even after a failure */
+    if ((bp_spi_submit_cs (bp, &cs, 0) || bp_spi_complete (bp, &cs)) && !result)
+        result = -1;
+
+    free (xfer);
+    free (lbuf);
+    return result;
+}
+
+int bp_spi_read_copy (void * ctx, uint32_t offset, int length, uint8_t * data) {
+    memcpy ((uint8_t *) ctx + offset, data, length);
+    return 0;
+}
+
+int bp_spi_read_compare (void * ctx, uint32_t offset, int length, uint8_t * data) {
+    return memcmp ((uint8_t *) ctx + offset, data, length) ? 1 : 0;
+}
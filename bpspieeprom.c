@@ -22,6 +22,8 @@
 #include <unistd.h>
 
 #include "buspirate.h"
+#include "bpstats.h"
+#include "bploop.h"
 
 enum BPSPIEEPROMCMDS {
     /* Basic Commands - M95** */
@@ -71,102 +73,92 @@ int bp_spi_eeprom_wrdisable (bp_state_t * bp) {
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
 
-int bp_spi_eeprom_read (bp_state_t * bp, int addr, int length, int addrbytes, uint8_t * buffer) {
-    int result, readbytes, total = 0;
-    uint8_t lbuf [TERMINAL_BUFFER];
-
-    while (total < length) {
-        readbytes = MIN(length-total, TERMINAL_BUFFER);
-        lbuf[0] = READ;
-        if (addrbytes == 1) {
-            lbuf[1] = addr & 0xff;
-        } else {
-            lbuf[1] = (addr >> 8) & 0xff;
-            lbuf[2] = addr & 0xff;
-        }
-        result = bp_spi_command (bp, addrbytes+1, readbytes, lbuf);
-        if (result == -1)
-            return -1;
-        memcpy (buffer+total, lbuf, readbytes);
-        addr+=readbytes;
-        total+=readbytes;
-    }
-
-    return 0;
+int bp_spi_eeprom_stream (bp_state_t * bp, uint32_t addr, uint32_t length, int addrbytes,
+                          bp_spi_chunk_t consumer, void * ctx) {
+    return bp_spi_read_memory (bp, READ, 0, addr, length, addrbytes, consumer, ctx);
 }
 
-int bp_spi_eeprom_verify (bp_state_t * bp, int addr, int length, int addrbytes, uint8_t * buffer) {
-    int result, readbytes, total = 0;
-    uint8_t lbuf [TERMINAL_BUFFER];
-
-    while (total < length) {
-        readbytes = MIN(length-total, TERMINAL_BUFFER);
-        lbuf[0] = READ;
-        if (addrbytes == 1) {
-            lbuf[1] = addr & 0xff;
-        } else {
-            lbuf[1] = (addr >> 8) & 0xff;
-            lbuf[2] = addr & 0xff;
-        }
-        result = bp_spi_command (bp, addrbytes+1, readbytes, lbuf);
-        if (result == -1)
-            return -1;
-        if (memcmp (buffer+total, lbuf, readbytes))
-            return 1;
-        addr+=readbytes;
-        total+=readbytes;
-    }
+int bp_spi_eeprom_read (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
+    return bp_spi_eeprom_stream (bp, addr, length, addrbytes, bp_spi_read_copy, buffer);
+}
 
-    return 0;
+int bp_spi_eeprom_verify (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
+    return bp_spi_read_memory (bp, READ, 0, addr, length, addrbytes, bp_spi_read_compare, buffer);
 }
 
-int _bp_spi_eeprom_write (bp_state_t * bp, int addr, int length, int addrbytes, uint8_t * buffer) {
+/* WREN, RDSR and WRITE leave the host as one transmission. The status read
+   in between tells if the write was accepted: a device still busy with an
+   earlier write cycle ignores both WREN and WRITE. Afterwards the write
+   cycle time learned from earlier pages (bp->twc) is slept off before
+   polling WIP in short intervals, until bp->tmax if that is set. */
+int _bp_spi_eeprom_write (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
     uint8_t lbuf [TERMINAL_BUFFER];
-    int result;
+    uint8_t wren, rdsr;
+    bp_spi_xfer_t xfer [3];
+    int result, tries, interval;
+    long start, polled;
 
-    if ((result = bp_spi_eeprom_rdsr (bp)) == -1)
-        return -1;
-    if (result & WIP) {
-        usleep (5000);
-        if ((result = bp_spi_eeprom_rdsr (bp)) == -1)
+    lbuf[0] = WRITE;
+    bp_spi_address (lbuf+1, addr, addrbytes);
+    memcpy (lbuf+addrbytes+1, buffer, length);
+
+    for (tries = 0; ; tries++) {
+        wren = WREN;
+        rdsr = RDSR;
+        xfer[0].writelen = 1; xfer[0].readlen = 0; xfer[0].buffer = &wren;
+        xfer[1].writelen = 1; xfer[1].readlen = 1; xfer[1].buffer = &rdsr;
+        xfer[2].writelen = length+addrbytes+1; xfer[2].readlen = 0; xfer[2].buffer = lbuf;
+        if (bp_spi_queue (bp, 3, xfer))
             return -1;
-        if (result & WIP)
+        start = bp_stats_now ();
+        if (!(rdsr & WIP))
+            break;
+        if (tries)
             return -2;
+        bp_sleep (bp->twc ? bp->twc : 5000);
     }
-    if (bp_spi_eeprom_wrenable (bp) == -1)
-        return -1;
-    if ((result = bp_spi_eeprom_rdsr (bp)) == -1)
-        return -1;
-    if (!(result & WEL))
+    if (!(rdsr & WEL))
         return -3;
 
-    lbuf[0] = WRITE;
-    if (addrbytes == 1) {
-        lbuf[1] = addr & 0xff;
+    if (bp->twc) {
+        bp_sleep (bp->twc - bp->twc/8);
+        interval = MAX(bp->twc/16, 100);
     } else {
-        lbuf[1] = (addr >> 8) & 0xff;
-        lbuf[2] = addr & 0xff;
+        bp_sleep (1000);
+        interval = 1000;
     }
-    memcpy (lbuf+3, buffer, length);
-    if (bp_spi_command (bp, length+addrbytes+1, 0, lbuf) == -1)
-        return -1;
-    do {
-        usleep (1000);
-        if ((result = bp_spi_eeprom_rdsr (bp)) == -1)
+    while (1) {
+        /* One poll round per interval */
+        if ((result = bp_spi_poll (bp, RDSR, WIP, MAX(bp->depth, 1), &polled)) == -1)
             return -1;
-        if (result & WEL)
-            return -4;
-    } while (result & WIP);
+        if (!(result & WIP))
+            break;
+        if (bp->tmax && polled - start > bp->tmax)
+            return -5;
+        bp_sleep (interval);
+    }
+    /* WEL is only reset by completing the write */
+    if (result & WEL)
+        return -4;
+
+    /* The cycle was over when the successful poll went out; timing its
+       answer would add the round trip to the estimate */
+    polled -= start;
+    bp_stats_add (&bp_stats.busy, polled);
+    bp->twc = bp->twc ? (3*bp->twc + polled) / 4 : polled;
 
     return 0;
 }
 
-int bp_spi_eeprom_write (bp_state_t * bp, int addr, int length, int addrbytes, int pagesize, uint8_t * buffer) {
+int bp_spi_eeprom_write (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize, uint8_t * buffer) {
     int result, l;
 
     if (addr % pagesize) {
-        l = pagesize - (addr % pagesize);
+        l = MIN(length, pagesize - (addr % pagesize));
         if ((result = _bp_spi_eeprom_write (bp, addr, l, addrbytes, buffer)))
             return result;
         addr += l;
@@ -187,3 +179,34 @@ int bp_spi_eeprom_write (bp_state_t * bp, int addr, int length, int addrbytes, i
 
     return 0;
 }
+
+/* Writes only the bytes of buffer that differ from old. Runs of changed
+   bytes in a page are merged when resending the unchanged bytes between
+   them is faster than another write cycle. */
+int bp_spi_eeprom_update (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize,
+                          const uint8_t * old, uint8_t * buffer) {
+    int result, i, end, from, to, gap;
+    int mergegap = ((bp->twc ? bp->twc : 5000) + 1000) / bp_byte_time (bp);
+
+    for (i=0; i<length; i=end) {
+        end = MIN(length, i + pagesize - ((addr+i) % pagesize));
+        for (from=i; from<end && old[from] == buffer[from]; from++) ;
+        while (from < end) {
+            /* Extend the run while the next change is close enough */
+            to = from+1;
+            for (gap=0; to+gap<end && gap<=mergegap; ) {
+                if (old[to+gap] != buffer[to+gap]) {
+                    to += gap+1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+            if ((result = _bp_spi_eeprom_write (bp, addr+from, to-from, addrbytes, buffer+from)))
+                return result;
+            for (from=to; from<end && old[from] == buffer[from]; from++) ;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "buspirate.h"
+#include "bpstats.h"
+#include "bploop.h"
+
+enum BPSPIFLASHCMDS {
+    /* Common SPI NOR commands - W25Q*, MX25L*, ... */
+    WRSR     = 0x01,
+    PP       = 0x02,     // Page program
+    READ     = 0x03,
+    WRDI     = 0x04,
+    RDSR     = 0x05,
+    WREN     = 0x06,
+    FASTREAD = 0x0b,     // Read with one dummy byte after the address
+    SE       = 0x20,     // 4k sector erase
+    BE32     = 0x52,     // 32k block erase
+    RDSFDP   = 0x5a,     // Serial flash discoverable parameters, JESD216
+    RDID     = 0x9f,     // JEDEC ID
+    EN4B     = 0xb7,     // Enter 4 byte address mode, parts beyond 16 MB
+    CE       = 0xc7,     // Chip erase
+    BE64     = 0xd8,     // 64k block erase
+    EX4B     = 0xe9      // Exit 4 byte address mode
+};
+
+enum BPSPIFLASHSRFLAGS {
+    WIP      = 0x01,     // Write in progress
+    WEL      = 0x02      // Write enable latch
+};
+
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+int bp_spi_flash_rdid (bp_state_t * bp, uint8_t * id) {
+    uint8_t buffer [3];
+
+    buffer[0] = RDID;
+    if (bp_spi_command (bp, 1, 3, buffer))
+        return -1;
+    memcpy (id, buffer, 3);
+    return 0;
+}
+
+/* SFDP is read with 3 address bytes and a dummy byte in any address mode */
+int bp_spi_flash_sfdp (bp_state_t * bp, uint32_t addr, int length, uint8_t * buffer) {
+    return bp_spi_read_memory (bp, RDSFDP, 1, addr, length, 3, bp_spi_read_copy, buffer);
+}
+
+int bp_spi_flash_rdsr (bp_state_t * bp) {
+    return bp_spi_command_short (bp, WR1RD1, RDSR, 0);
+}
+
+/* Switches the common commands between 3 and 4 address bytes. Some parts
+   only take EN4B after WREN, so it's sent in between WREN and WRDI. */
+int bp_spi_flash_4byte (bp_state_t * bp, int enable) {
+    uint8_t commands [3] = { WREN, EN4B, WRDI };
+    bp_spi_xfer_t xfer [3];
+    int i;
+
+    if (!enable)
+        commands[1] = EX4B;
+    for (i=0; i<3; i++) {
+        xfer[i].writelen = 1;
+        xfer[i].readlen = 0;
+        xfer[i].buffer = &commands[i];
+    }
+    return bp_spi_queue (bp, 3, xfer) ? -1 : 0;
+}
+
+/* Erase times span milliseconds to minutes, so the poll interval grows
+   with the time already waited, keeping the overshoot below 1/8. Gives up
+   after timeout us, unless that is 0. */
+static int _bp_spi_flash_wait (bp_state_t * bp, long timeout) {
+    long start = bp_stats_now (), waited;
+    int result;
+
+    while (1) {
+        bp_sleep (MIN(1000 + (bp_stats_now () - start) / 8, 100000));
+        waited = bp_stats_now () - start;
+        if ((result = bp_spi_flash_rdsr (bp)) == -1)
+            return -1;
+        bp_stats.probes++;
+        if (!(result & WIP)) {
+            bp_stats_add (&bp_stats.busy, bp_stats_now () - start);
+            return 0;
+        }
+        if (timeout && waited > timeout)
+            return -5;
+    }
+}
+
+/* Sends WREN, RDSR and the command as one transmission. The status read in
+   between tells if the device was ready and accepted the write enable. A
+   device still busy, e.g. with an erase of an aborted run, ignored both,
+   so the command is sent again once it is done. */
+static int _bp_spi_flash_enable_and_send (bp_state_t * bp, int length, uint8_t * buffer) {
+    uint8_t wren, rdsr;
+    bp_spi_xfer_t xfer [3];
+    int result, tries;
+
+    for (tries = 0; ; tries++) {
+        wren = WREN;
+        rdsr = RDSR;
+        xfer[0].writelen = 1; xfer[0].readlen = 0; xfer[0].buffer = &wren;
+        xfer[1].writelen = 1; xfer[1].readlen = 1; xfer[1].buffer = &rdsr;
+        xfer[2].writelen = length; xfer[2].readlen = 0; xfer[2].buffer = buffer;
+        if (bp_spi_queue (bp, 3, xfer))
+            return -1;
+        if (!(rdsr & WIP))
+            break;
+        if (tries)
+            return -2;
+        /* Whatever it is busy with, it's no longer than a chip erase */
+        if ((result = _bp_spi_flash_wait (bp, MAX(MAX(bp->tsemax, bp->tbe32max),
+                                                  MAX(bp->tbe64max, bp->tcemax)))))
+            return result;
+    }
+    if (!(rdsr & WEL))
+        return -3;
+    return 0;
+}
+
+static int _bp_spi_flash_erase (bp_state_t * bp, uint8_t opcode, uint32_t addr, int addrbytes, long timeout) {
+    uint8_t buffer [5];
+    int result;
+
+    buffer[0] = opcode;
+    if (addrbytes)
+        bp_spi_address (buffer+1, addr, addrbytes);
+    if ((result = _bp_spi_flash_enable_and_send (bp, addrbytes+1, buffer)))
+        return result;
+    return _bp_spi_flash_wait (bp, timeout);
+}
+
+int bp_spi_flash_erase_sector (bp_state_t * bp, uint32_t addr, int addrbytes) {
+    return _bp_spi_flash_erase (bp, SE, addr, addrbytes, bp->tsemax);
+}
+
+int bp_spi_flash_erase_block32 (bp_state_t * bp, uint32_t addr, int addrbytes) {
+    return _bp_spi_flash_erase (bp, BE32, addr, addrbytes, bp->tbe32max);
+}
+
+int bp_spi_flash_erase_block64 (bp_state_t * bp, uint32_t addr, int addrbytes) {
+    return _bp_spi_flash_erase (bp, BE64, addr, addrbytes, bp->tbe64max);
+}
+
+int bp_spi_flash_erase_chip (bp_state_t * bp) {
+    return _bp_spi_flash_erase (bp, CE, 0, 0, bp->tcemax);
+}
+
+int bp_spi_flash_stream (bp_state_t * bp, uint32_t addr, uint32_t length, int addrbytes,
+                         bp_spi_chunk_t consumer, void * ctx) {
+    return bp_spi_read_memory (bp, FASTREAD, 1, addr, length, addrbytes, consumer, ctx);
+}
+
+int bp_spi_flash_read (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
+    return bp_spi_flash_stream (bp, addr, length, addrbytes, bp_spi_read_copy, buffer);
+}
+
+int bp_spi_flash_verify (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
+    return bp_spi_read_memory (bp, FASTREAD, 1, addr, length, addrbytes, bp_spi_read_compare, buffer);
+}
+
+/* Programs one page. Like the EEPROM writes, the page program time learned
+   from earlier pages (bp->tpp) is slept off before polling WIP, until
+   bp->tmax if that is set. */
+static int _bp_spi_flash_program (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer) {
+    uint8_t lbuf [TERMINAL_BUFFER];
+    int result, interval;
+    long start, polled;
+
+    lbuf[0] = PP;
+    bp_spi_address (lbuf+1, addr, addrbytes);
+    memcpy (lbuf+addrbytes+1, buffer, length);
+    if ((result = _bp_spi_flash_enable_and_send (bp, length+addrbytes+1, lbuf)))
+        return result;
+    start = bp_stats_now ();
+
+    if (bp->tpp) {
+        bp_sleep (bp->tpp - bp->tpp/8);
+        interval = MAX(bp->tpp/16, 50);
+    } else {
+        interval = 100;
+    }
+    while (1) {
+        /* One poll round per interval */
+        if ((result = bp_spi_poll (bp, RDSR, WIP, MAX(bp->depth, 1), &polled)) == -1)
+            return -1;
+        if (!(result & WIP))
+            break;
+        if (bp->tmax && polled - start > bp->tmax)
+            return -5;
+        bp_sleep (interval);
+    }
+
+    /* Timed to the poll that saw the program finish, like EEPROM writes */
+    polled -= start;
+    bp_stats_add (&bp_stats.busy, polled);
+    bp->tpp = bp->tpp ? (3*bp->tpp + polled) / 4 : polled;
+
+    return 0;
+}
+
+/* Programs erased flash, splitting at page boundaries */
+int bp_spi_flash_program (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize, uint8_t * buffer) {
+    int result, l;
+
+    while (length > 0) {
+        l = MIN(length, pagesize - (addr % pagesize));
+        if ((result = _bp_spi_flash_program (bp, addr, l, addrbytes, buffer)))
+            return result;
+        addr += l;
+        buffer += l;
+        length -= l;
+    }
+
+    return 0;
+}
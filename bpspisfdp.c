@@ -0,0 +1,152 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Flash detection from the JEDEC ID and the basic flash parameter table
+ * (BFPT) of JESD216 SFDP.
+ */
+
+#include <string.h>
+
+#include "buspirate.h"
+
+#define BPSFDPHEADERS 16      // Parameter headers looked at
+#define BPSFDPDWORDS 16       // BFPT dwords used, as far as JESD216B
+
+/* The erase operations the tool sends, with the times assumed when the
+   table has none */
+static const struct {
+    int size;
+    uint8_t opcode;
+    int time;
+} erase_ops [] = {
+    { 4096, 0x20, 45000 }, { 32768, 0x52, 120000 }, { 65536, 0xd8, 150000 }
+};
+
+/* SFDP time fields are a 5 bit count - 1 followed by a unit index */
+static int _bp_sfdp_time (uint32_t field, const int * units) {
+    return ((field & 0x1f) + 1) * units[(field >> 5) & 3];
+}
+
+static uint32_t _bp_sfdp_dword (const uint8_t * data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+/* Capacity from the third ID byte, 2^n bytes on most vendors' parts */
+static int _bp_spi_flash_probe_id (const uint8_t * id, bp_device_t * device) {
+    if (id[2] < 0x10 || id[2] > 0x1f)
+        return -2;
+    device->capacity = 1ULL << id[2];
+    device->addresslength = device->capacity > 16777216 ? 4 : 3;
+    device->sectorsize = 4096;
+    device->pagesize = 256;
+    device->tpp = 700;
+    device->tse = 45000;
+    device->tbe32 = 120000;
+    device->tbe64 = 150000;
+    return 1;
+}
+
+static int _bp_spi_flash_parse_bfpt (const uint32_t * d, int dwords, bp_device_t * device) {
+    static const int erase_units [4] = { 1000, 16000, 128000, 1000000 };
+    static const int chip_units [4] = { 16000, 256000, 4000000, 64000000 };
+    static const int pp_units [4] = { 8, 64, 8, 64 }; // Only bit 13 is the unit
+    int * times [3] = { &device->tse, &device->tbe32, &device->tbe64 };
+    int i, j, size, opcode;
+
+    if (dwords < 9)
+        return -3;
+    device->capacity = d[1] & 0x80000000 ? (1ULL << (d[1] & 0x3f)) / 8 : (d[1] + 1ULL) / 8;
+    switch ((d[0] >> 17) & 3) {
+    case 0: device->addresslength = 3; break;
+    case 1: device->addresslength = device->capacity > 16777216 ? 4 : 3; break;
+    case 2: device->addresslength = 4; break;
+    default: return -3;
+    }
+
+    /* Typical times only came with JESD216A, older tables get the defaults */
+    device->pagesize = 256;
+    device->tpp = 700;
+    device->tce = 0;
+    for (i=0; i<4; i++) {
+        size = (d[7 + i/2] >> (16 * (i%2))) & 0xff;
+        opcode = (d[7 + i/2] >> (16 * (i%2) + 8)) & 0xff;
+        /* Untrusted, and shifting by 31 or more is undefined */
+        if (size > 16)
+            continue;
+        for (j=0; j<3 && size; j++)
+            if (erase_ops[j].size == 1 << size && erase_ops[j].opcode == opcode)
+                *times[j] = dwords > 9 ? _bp_sfdp_time (d[9] >> (4 + 7*i), erase_units) :
+                                         erase_ops[j].time;
+    }
+    if (dwords > 10) {
+        device->pagesize = 1 << ((d[10] >> 4) & 0xf);
+        device->tpp = _bp_sfdp_time (d[10] >> 8, pp_units);
+        device->tce = _bp_sfdp_time (d[10] >> 24, chip_units);
+    }
+
+    /* Sectors are erased with 0x20, parts without it can't be handled */
+    if (!device->tse)
+        return -3;
+    device->sectorsize = 4096;
+    return 0;
+}
+
+/* Fills in device from the flash's SFDP tables, or from its JEDEC ID
+   where there are none. Returns 0 with SFDP, 1 with the ID only, -1 if
+   the transfer failed, -2 if no flash answered and -3 if the tables
+   describe a part the tool can't program. */
+int bp_spi_flash_probe (bp_state_t * bp, bp_device_t * device) {
+    uint8_t id [3], header [8 + 8*BPSFDPHEADERS], table [4*BPSFDPDWORDS];
+    uint32_t dword [BPSFDPDWORDS], pointer;
+    int i, j, headers, dwords;
+
+    memset (device, 0, sizeof (bp_device_t));
+    if (bp_spi_flash_rdid (bp, id))
+        return -1;
+    /* Nothing on the bus reads as all ones or all zeros */
+    if ((id[0] == 0xff && id[1] == 0xff) || (id[0] == 0 && id[1] == 0))
+        return -2;
+    device->flags = BPDFFLASH;
+    device->id = id[0] << 16 | id[1] << 8 | id[2];
+
+    if (bp_spi_flash_sfdp (bp, 0, 8, header))
+        return -1;
+    if (memcmp (header, "SFDP", 4) || header[5] != 1)
+        return _bp_spi_flash_probe_id (id, device);
+    headers = header[6] + 1 < BPSFDPHEADERS ? header[6] + 1 : BPSFDPHEADERS;
+    if (bp_spi_flash_sfdp (bp, 8, 8*headers, header+8))
+        return -1;
+
+    /* The BFPT has ID 0xFF00 and major revision 1 */
+    for (i=0; i<headers; i++) {
+        uint8_t * h = header + 8 + 8*i;
+
+        if (h[0] != 0x00 || h[7] != 0xff || h[2] != 1)
+            continue;
+        pointer = h[4] | h[5] << 8 | h[6] << 16;
+        dwords = h[3] < BPSFDPDWORDS ? h[3] : BPSFDPDWORDS;
+        if (bp_spi_flash_sfdp (bp, pointer, 4*dwords, table))
+            return -1;
+        for (j=0; j<dwords; j++)
+            dword[j] = _bp_sfdp_dword (table + 4*j);
+        return _bp_spi_flash_parse_bfpt (dword, dwords, device);
+    }
+    return _bp_spi_flash_probe_id (id, device);
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Counters and latency histograms of the serial and SPI layers, printed
+ * with --stats after the command.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "bpstats.h"
+
+bp_stats_t bp_stats;
+
+static const char * phasenames [BPPHASES] = {
+    "open", "reset", "rate", "spi_enter", "command"
+};
+
+long bp_stats_now (void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bp_stats_add (bp_histogram_t * histogram, long us) {
+    int bucket = 0;
+
+    if (us < 0)
+        us = 0;
+    while (bucket < BPSTATBUCKETS-1 && us >> (bucket+1))
+        bucket++;
+    histogram->count++;
+    histogram->total += us;
+    if (us > histogram->max)
+        histogram->max = us;
+    histogram->bucket[bucket]++;
+}
+
+/* Adds the time since start to phase */
+void bp_stats_phase (int phase, long start) {
+    bp_stats.phase[phase] += bp_stats_now () - start;
+}
+
+void bp_stats_reset (void) {
+    memset (&bp_stats, 0, sizeof (bp_stats));
+}
+
+static unsigned long transactions (void) {
+    unsigned long total = 0;
+    int i;
+
+    for (i=0; i<256; i++)
+        total += bp_stats.opcode[i];
+    return total;
+}
+
+static void print_histogram_text (FILE * out, const char * name, bp_histogram_t * h) {
+    fprintf (out, "  %-10s %8lu, total %llu us, avg %llu us, max %lu us\n", name, h->count,
+             h->total, h->count ? h->total / h->count : 0, h->max);
+}
+
+static void print_histogram_json (FILE * out, const char * name, bp_histogram_t * h) {
+    int i, last;
+
+    for (last=BPSTATBUCKETS-1; last>0 && !h->bucket[last]; last--) ;
+    fprintf (out, "\"%s\": {\"count\": %lu, \"total_us\": %llu, \"max_us\": %lu, \"log2_us_buckets\": [",
+             name, h->count, h->total, h->max);
+    for (i=0; i<=last; i++)
+        fprintf (out, "%s%lu", i ? ", " : "", h->bucket[i]);
+    fprintf (out, "]}");
+}
+
+static void print_text (FILE * out) {
+    int i;
+
+    fprintf (out, "Statistics:\n");
+    for (i=0; i<BPPHASES; i++)
+        fprintf (out, "  %-10s %8lld us\n", phasenames[i], bp_stats.phase[i]);
+    fprintf (out, "  bytes out  %8llu\n  bytes in   %8llu\n", bp_stats.bytesout, bp_stats.bytesin);
+    print_histogram_text (out, "writes", &bp_stats.write);
+    print_histogram_text (out, "reads", &bp_stats.read);
+    print_histogram_text (out, "waits", &bp_stats.wait);
+    fprintf (out, "  SPI transactions %lu:", transactions ());
+    for (i=0; i<256; i++)
+        if (bp_stats.opcode[i])
+            fprintf (out, " %02X:%lu", i, bp_stats.opcode[i]);
+    fprintf (out, "\n");
+    print_histogram_text (out, "busy", &bp_stats.busy);
+    fprintf (out, "  probes     %8lu\n", bp_stats.probes);
+}
+
+static void print_json (FILE * out) {
+    int i, first = 1;
+
+    fprintf (out, "{\"phases_us\": {");
+    for (i=0; i<BPPHASES; i++)
+        fprintf (out, "%s\"%s\": %lld", i ? ", " : "", phasenames[i], bp_stats.phase[i]);
+    fprintf (out, "},\n \"serial\": {\"bytes_out\": %llu, \"bytes_in\": %llu,\n  ",
+             bp_stats.bytesout, bp_stats.bytesin);
+    print_histogram_json (out, "writes", &bp_stats.write);
+    fprintf (out, ",\n  ");
+    print_histogram_json (out, "reads", &bp_stats.read);
+    fprintf (out, ",\n  ");
+    print_histogram_json (out, "waits", &bp_stats.wait);
+    fprintf (out, "},\n \"spi\": {\"transactions\": %lu, \"opcodes\": {", transactions ());
+    for (i=0; i<256; i++)
+        if (bp_stats.opcode[i]) {
+            fprintf (out, "%s\"0x%02x\": %lu", first ? "" : ", ", i, bp_stats.opcode[i]);
+            first = 0;
+        }
+    fprintf (out, "},\n  \"probes\": %lu, ", bp_stats.probes);
+    print_histogram_json (out, "busy", &bp_stats.busy);
+    fprintf (out, "}}\n");
+}
+
+void bp_stats_print (FILE * out, int format) {
+    if (format == BPSFTEXT)
+        print_text (out);
+    else if (format == BPSFJSON)
+        print_json (out);
+    fflush (out);
+}
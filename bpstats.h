@@ -0,0 +1,71 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __BPSTATS_H__
+#define __BPSTATS_H__
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#define BPSTATBUCKETS 24      // Histogram buckets, bucket n counts [2^n, 2^(n+1)) us
+
+enum BPSTATPHASES {
+    BPPHOPEN,                 // bp_open as a whole, including reset and rate
+    BPPHRESET,
+    BPPHRATE,
+    BPPHSPIENTER,
+    BPPHCOMMAND,
+    BPPHASES
+};
+
+enum BPSTATFORMATS {
+    BPSFNONE,
+    BPSFTEXT,
+    BPSFJSON
+};
+
+typedef struct bp_histogram_s {
+    unsigned long count;
+    unsigned long long total; // us
+    unsigned long max;
+    unsigned long bucket [BPSTATBUCKETS];
+} bp_histogram_t;
+
+typedef struct bp_stats_s {
+    unsigned long long bytesout;
+    unsigned long long bytesin;
+    bp_histogram_t write;     // write syscalls
+    bp_histogram_t read;      // read syscalls
+    bp_histogram_t wait;      // Waits for an answer that wasn't there yet
+    unsigned long opcode [256]; // SPI transactions by their first byte
+    unsigned long probes;     // Status register polls sent
+    bp_histogram_t busy;      // Write, program and erase cycles until WIP cleared
+    long long phase [BPPHASES];
+} bp_stats_t;
+
+/* The event loop swaps in each session's own copy while it runs */
+extern bp_stats_t bp_stats;
+
+long bp_stats_now (void);
+void bp_stats_add (bp_histogram_t * histogram, long us);
+void bp_stats_phase (int phase, long start);
+void bp_stats_reset (void);
+void bp_stats_print (FILE * out, int format);
+
+#endif
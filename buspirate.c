@@ -24,6 +24,31 @@
 
 #include "serial.h"
 #include "buspirate.h"
+#include "bpstats.h"
+#include "bploop.h"
+
+/* Serial transfer time of a byte at the bus pirate's current rate, with
+   start and stop bit, in us */
+long bp_byte_time (bp_state_t * bp) {
+    long bps;
+
+    switch (bp->devicerate) {
+    case B300: bps = 300; break;
+    case B1200: bps = 1200; break;
+    case B2400: bps = 2400; break;
+    case B4800: bps = 4800; break;
+    case B9600: bps = 9600; break;
+    case B19200: bps = 19200; break;
+    case B38400: bps = 38400; break;
+    case B57600: bps = 57600; break;
+    case B230400: bps = 230400; break;
+    case B460800: bps = 460800; break;
+    case B1000000: bps = 1000000; break;
+    case B2000000: bps = 2000000; break;
+    default: bps = 115200; break;
+    }
+    return (10000000 + bps/2) / bps;
+}
 
 int bp_set_rate (bp_state_t * bp, tcflag_t newrate) {
     char buffer [256];
@@ -73,16 +98,53 @@ int bp_set_rate (bp_state_t * bp, tcflag_t newrate) {
         return 1;
     serWriteLine (bp->fd, 0, " ");
     while ((result = serReadLine (bp->fd, sizeof (buffer), buffer)) >= 0)
-        if (!strcmp (buffer, "HiZ>"))
+        if (!strcmp (buffer, "HiZ>")) {
+            bp->devicerate = newrate;
             return 0;
-        else
+        } else
             printf ("Received: %s\n", buffer);
     return 1;
 }
 
+/* Checks whether the bus pirate is still in binary mode at the requested
+   rate, as left behind by a run with -k or an aborted one. 0x00 answers
+   BBIOx in binary mode and leaves any binary submode; in terminal mode it
+   is just one of the 20 zeros that enter binary mode. Stale answers of an
+   aborted run are skipped by trying again. */
+static int bp_attach (bp_state_t * bp) {
+    char buffer [64];
+    int i, result, length = 0;
+
+    if ((bp->fd = serOpenPort (bp->devicename, bp->devicerate)) == -1)
+        return 1;
+    for (i=0; i<BPATTACHTRIES; i++) {
+        serWriteChar (bp->fd, BPBCENTER);
+        while (length < sizeof (buffer) - 1 &&
+               (result = serReadTimed (bp->fd, BPATTACHTIMEOUT, 1, (uint8_t *) buffer+length)) == 1) {
+            buffer[++length] = 0;
+            if (length >= 5 && !strncmp (buffer+length-5, "BBIO", 4)) {
+                bp->mode = BPMBINARY;
+                bp->submode = BPSMHIZ;
+                bp->bm_version = buffer[length-1] - '0';
+                return 0;
+            }
+        }
+        if (!length)
+            break;
+        length = 0;
+    }
+    serClosePort (bp->fd);
+    return 1;
+}
+
 int bp_open (bp_state_t * bp) {
     char buffer [256];
     tcflag_t rate = bp->devicerate;
+    long start;
+    int result;
+
+    if (!bp_attach (bp))
+        return 0;
 
 /* Open the device */
     if ((bp->fd = serOpenPort (bp->devicename, B115200)) == -1)
@@ -92,11 +154,17 @@ int bp_open (bp_state_t * bp) {
         printf ("%s", buffer);
 
     bp->mode = BPMUNKNOWN;
-    if (bp_reset (bp))
+    start = bp_stats_now ();
+    result = bp_reset (bp);
+    bp_stats_phase (BPPHRESET, start);
+    if (result)
         return 1;
 
     bp->devicerate = B115200;
-    if (bp_set_rate (bp, rate)) {
+    start = bp_stats_now ();
+    result = bp_set_rate (bp, rate);
+    bp_stats_phase (BPPHRATE, start);
+    if (result) {
         fprintf (stderr, "WARNING: serial port rate setting failed!\nThe bus pirate may be in undefined state.\n");
         return 1;
     }
@@ -129,7 +197,7 @@ int bp_reset (bp_state_t * bp) {
 
     for (i=0; i<20 && !is_reset; i++) {
         serWriteChar (bp->fd, BPBCRESET);
-        usleep (20000);
+        bp_sleep (20000);
         while (serReadLine (bp->fd, sizeof (buffer), buffer) >= 0) {
             if (strstr (buffer, "Bus Pirate"))
                 is_reset = 1;
@@ -159,27 +227,37 @@ int bp_reset (bp_state_t * bp) {
 }
 
 int bp_mode (bp_state_t * bp, int newmode) {
-    int i, result;
+    int i, result, length = 0;
     char buffer [256];
 
     switch (newmode) {
     case BPMBINARY:
         for (i=0; i<20; i++) {
             serWriteChar (bp->fd, BPBCENTER);
-            if ((result = serReadTimed (bp->fd, 2000, 5, (uint8_t *) buffer)) > 0) {
+            /* The answer to the 20th zero may take a USB round trip;
+               stop reading as soon as BBIOx is complete */
+            while ((result = serReadSome (bp->fd, i < 19 ? 2000 : BPATTACHTIMEOUT,
+                                          sizeof (buffer) - 1 - length, (uint8_t *) buffer + length)) > 0) {
                 // A BEL (0x07) as return means inappropiate char
-                if (result == 1 && buffer[0] == 7)
+                if (result == 1 && !length && buffer[0] == 7)
                     return 1;
                 // A 0x01 as result means we are in binary state, but the command is not valid
-                if (result == 1 && buffer[0] == 1)
+                if (result == 1 && !length && buffer[0] == 1)
                     return 1;
-                buffer[result] = 0;
-                if (result == 5 && !(strncmp (buffer, "BBIO", 4))) {
+                length += result;
+                buffer[length] = 0;
+                if (length >= 5 && !(strncmp (buffer+length-5, "BBIO", 4))) {
                     bp->mode = BPMBINARY;
                     bp->submode = BPSMHIZ;
-                    bp->bm_version = buffer[4] - '0';
+                    bp->bm_version = buffer[length-1] - '0';
+                    /* Already in binary mode, the zeros sent before the
+                       answer arrived are answered, too */
+                    if (i && i < 19)
+                        while (serReadTimed (bp->fd, BPATTACHTIMEOUT, sizeof (buffer), (uint8_t *) buffer) > 0) ;
                     return 0;
                 }
+                if (length > sizeof (buffer) - 6)
+                    length = 0;
             }
         }
         break;
@@ -188,10 +266,10 @@ int bp_mode (bp_state_t * bp, int newmode) {
         case BPMBINARY:
             if (bp->submode != BPSMHIZ) {
                 bp_mode (bp, BPMBINARY);
-                usleep (20000);
+                bp_sleep (20000);
             }
             serWriteChar (bp->fd, BPBCRESET);
-            usleep (20000);
+            bp_sleep (20000);
             while (serReadLine (bp->fd, sizeof (buffer), buffer) >= 0);
             bp->mode = BPMTERMINAL;
             bp->submode = BPSMHIZ;
@@ -24,6 +24,12 @@
 #include <termios.h>
 
 #define TERMINAL_BUFFER 4096  // From buspirate firmware, busPirateCore.h
+#define BPSPIQUEUEDEPTH 1     // SPI transactions sent ahead of their answers, see -Q
+#define BPSPIQUEUEMAX 64
+#define BPSPIBULKMAX 16       // Bytes of a BPSPIWRITE bulk transfer
+#define BPUARTFIFO 4          // Receive and transmit FIFOs of the PIC's UART
+#define BPATTACHTRIES 4       // Probes for a bus pirate left in binary mode
+#define BPATTACHTIMEOUT 50000 // Covers the latency timer of USB-to-Serial converters, in us
 
 enum BPMODES {
     BPMUNKNOWN,
@@ -50,6 +56,17 @@ typedef struct bp_state_s {
     int sw_version;
     int sw_revision;
     int bl_version;
+    int depth;                // Maximum number of queued SPI transactions in flight
+    unsigned int txseq;       // Queued SPI transactions sent
+    unsigned int rxseq;       // Queued SPI transactions answered
+    int twc;                  // Write cycle time learned from earlier writes, in us
+    int tpp;                  // Flash page program time learned from earlier pages, in us
+    int tmax;                 // Write cycle or page program time after which to give up, 0 for never
+    long tsemax;              // Erase times after which to give up, 0 for never
+    long tbe32max;
+    long tbe64max;
+    long tcemax;
+    int csopened;             // CS was just asserted, the next byte sent is an opcode
 } bp_state_t;
 
 enum BPDEVICEFLAGS {
@@ -60,13 +77,41 @@ enum BPDEVICEFLAGS {
 
 typedef struct bp_device_s {
     char * devicename;
-    int capacity;
+    unsigned long long capacity;
     int addresslength;
     int sectorsize;
     int pagesize;
     int flags;
+    int tpp;                  // Typical page program (EEPROM write cycle) and
+    int tse;                  // erase times in us, 0 where the device lacks
+    int tbe32;                // the operation
+    int tbe64;
+    int tce;
+    int tppmax;               // Longest page program or write cycle in us, 0 if unknown
+    int maxkhz;               // Fastest SPI clock the part takes, 0 if unknown
+    uint32_t id;              // JEDEC ID, 0 if unknown
 } bp_device_t;
 
+typedef struct bp_spi_xfer_s {
+    int writelen;
+    int readlen;
+    uint8_t * buffer;         // Write data, overwritten by the read data
+    int result;
+    int pending;
+    int frame;                // How the transaction was sent, set by submit
+    int cs;                   // CS commands sent before and after it
+    unsigned int seq;
+} bp_spi_xfer_t;
+
+enum BPSPIFRAMES {
+    BPSPIFRAMEWRITEREAD,      // BPSPIWRITEREAD(NO)CS with header
+    BPSPIFRAMEBULK,           // BPSPIWRITE bulk transfer
+    BPSPIFRAMECS              // CS change only
+};
+
+/* Consumer for chunks of memory read, returns 0 to continue */
+typedef int (*bp_spi_chunk_t) (void * ctx, uint32_t offset, int length, uint8_t * data);
+
 enum BPPINS {
     BPPCS              = 0x01,
     BPPMISO            = 0x02,
@@ -147,18 +192,51 @@ enum BPSPISHORTFLAGS {
 
 int bp_open (bp_state_t * bp);
 int bp_reset (bp_state_t * bp);
+int bp_set_rate (bp_state_t * bp, tcflag_t newrate);
+long bp_byte_time (bp_state_t * bp);
 int bp_mode (bp_state_t * bp, int newmode);
 
 int bp_spi_enter (bp_state_t * bp);
 int bp_spi_command (bp_state_t * bp, int writelen, int readlen, uint8_t * buffer);
+long bp_spi_roundtrip (bp_state_t * bp, int count);
+int bp_spi_poll (bp_state_t * bp, uint8_t command, uint8_t mask, int probes, long * sent);
 int bp_spi_command_short (bp_state_t * bp, int flags, uint8_t command, uint8_t data);
+int bp_spi_submit (bp_state_t * bp, bp_spi_xfer_t * xfer);
+int bp_spi_submit_nocs (bp_state_t * bp, bp_spi_xfer_t * xfer);
+int bp_spi_submit_cs (bp_state_t * bp, bp_spi_xfer_t * xfer, int state);
+int bp_spi_complete (bp_state_t * bp, bp_spi_xfer_t * xfer);
+int bp_spi_queue (bp_state_t * bp, int count, bp_spi_xfer_t * xfers);
+int bp_spi_address (uint8_t * buffer, uint32_t addr, int addrbytes);
+int bp_spi_read_memory (bp_state_t * bp, uint8_t opcode, int dummy, uint32_t addr, uint32_t length,
+                        int addrbytes, bp_spi_chunk_t consumer, void * ctx);
+int bp_spi_read_copy (void * ctx, uint32_t offset, int length, uint8_t * data);
+int bp_spi_read_compare (void * ctx, uint32_t offset, int length, uint8_t * data);
 
 int bp_spi_eeprom_rdsr (bp_state_t * bp);
 int bp_spi_eeprom_wrsr (bp_state_t * bp, uint8_t data);
 int bp_spi_eeprom_wrenable (bp_state_t * bp);
 int bp_spi_eeprom_wrdisable (bp_state_t * bp);
-int bp_spi_eeprom_read (bp_state_t * bp, int addr, int length, int addrbytes, uint8_t * buffer);
-int bp_spi_eeprom_verify (bp_state_t * bp, int addr, int length, int addrbytes, uint8_t * buffer);
-int bp_spi_eeprom_write (bp_state_t * bp, int addr, int length, int addrbytes, int pagesize, uint8_t * buffer);
+int bp_spi_eeprom_stream (bp_state_t * bp, uint32_t addr, uint32_t length, int addrbytes,
+                          bp_spi_chunk_t consumer, void * ctx);
+int bp_spi_eeprom_read (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer);
+int bp_spi_eeprom_verify (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer);
+int bp_spi_eeprom_write (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize, uint8_t * buffer);
+int bp_spi_eeprom_update (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize,
+                          const uint8_t * old, uint8_t * buffer);
+
+int bp_spi_flash_rdid (bp_state_t * bp, uint8_t * id);
+int bp_spi_flash_sfdp (bp_state_t * bp, uint32_t addr, int length, uint8_t * buffer);
+int bp_spi_flash_probe (bp_state_t * bp, bp_device_t * device);
+int bp_spi_flash_rdsr (bp_state_t * bp);
+int bp_spi_flash_4byte (bp_state_t * bp, int enable);
+int bp_spi_flash_erase_sector (bp_state_t * bp, uint32_t addr, int addrbytes);
+int bp_spi_flash_erase_block32 (bp_state_t * bp, uint32_t addr, int addrbytes);
+int bp_spi_flash_erase_block64 (bp_state_t * bp, uint32_t addr, int addrbytes);
+int bp_spi_flash_erase_chip (bp_state_t * bp);
+int bp_spi_flash_stream (bp_state_t * bp, uint32_t addr, uint32_t length, int addrbytes,
+                         bp_spi_chunk_t consumer, void * ctx);
+int bp_spi_flash_read (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer);
+int bp_spi_flash_verify (bp_state_t * bp, uint32_t addr, int length, int addrbytes, uint8_t * buffer);
+int bp_spi_flash_program (bp_state_t * bp, uint32_t addr, int length, int addrbytes, int pagesize, uint8_t * buffer);
 
 #endif
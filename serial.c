@@ -18,20 +18,233 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include "serial.h"
+#include "bpstats.h"
+#include "bploop.h"
 
 #define TIMEOUT 100000
 
+#define SERRXBUFFER 8192      // Must be a power of two
+#define SERTXBUFFER 8192      // Holds at least one full 4k write-then-read frame
+
+/* Per port buffers: writes are collected in tx until flushed, reads
+   fill the rx ring in large chunks and are served from there */
+typedef struct ser_port_s {
+    uint8_t rx [SERRXBUFFER];
+    unsigned int rxhead;      // free running, rxhead - rxtail bytes are buffered
+    unsigned int rxtail;
+    uint8_t tx [SERTXBUFFER];
+    int txlen;
+    char timerpath [PATH_MAX]; // latency_timer to restore on close
+    int timer;
+    int serialflags;          // Serial flags to restore on close, -1 if untouched
+} ser_port_t;
+
+static ser_port_t * ports [FD_SETSIZE];
+
+/* Serial traces hold every chunk written to or read from the port. The
+   file starts with SERTRACEMAGIC and a version byte, followed by one
+   record per chunk: its direction byte, the time since the previous chunk
+   in us and its length as LEB128 varints, then the data. */
+#define SERTRACEMAGIC "SPTR"
+#define SERTRACEVERSION 1
+
+static FILE * tracefile;
+static long tracetime;        // Time of the last chunk recorded
+
+/* Replay serves the chunks read from a trace instead of the port. An
+   answer becomes available once the bytes sent before it in the trace have
+   been written, after the time it took to arrive in the trace. */
+typedef struct ser_replay_in_s {
+    ser_trace_chunk_t * chunk;
+    long gap;                 // Time from the last chunk written to this one
+    long ready;               // When it becomes available, once scheduled
+} ser_replay_in_t;
+
+static struct {
+    ser_trace_t trace;
+    uint8_t * out;            // All bytes written in the trace
+    unsigned long outlen;
+    unsigned long outpos;     // Bytes written during the replay
+    ser_replay_in_t * in;
+    int incount;
+    int next;                 // Answer to be read next
+    int offset;               // Bytes of it read already
+    int scheduled;            // Answers with a ready time
+    int active;
+    int diverged;
+} replay;
+
+static void ser_trace_varint (unsigned long value) {
+    do {
+        fputc ((value & 0x7f) | (value > 0x7f ? 0x80 : 0), tracefile);
+        value >>= 7;
+    } while (value);
+}
+
+static void ser_trace (int dir, const uint8_t * buffer, int length) {
+    long now;
+
+    if (!tracefile || length <= 0)
+        return;
+    now = bp_stats_now ();
+    fputc (dir, tracefile);
+    ser_trace_varint (now - tracetime);
+    ser_trace_varint (length);
+    fwrite (buffer, 1, length, tracefile);
+    tracetime = now;
+}
+
+static void ser_replay_schedule (void) {
+    long now = bp_stats_now ();
+
+    while (replay.scheduled < replay.incount &&
+           replay.in[replay.scheduled].chunk->outpos <= replay.outpos) {
+        replay.in[replay.scheduled].ready = now + replay.in[replay.scheduled].gap;
+        replay.scheduled++;
+    }
+}
+
+/* Writes during a replay must match the trace */
+static int ser_replay_write (int length, const uint8_t * buffer) {
+    if (replay.outpos + length > replay.outlen ||
+        memcmp (replay.out + replay.outpos, buffer, length)) {
+        if (!replay.diverged++)
+            fprintf (stderr, "Replay diverges from the trace after %lu bytes written.\n", replay.outpos);
+        return -1;
+    }
+    replay.outpos += length;
+    ser_replay_schedule ();
+    return length;
+}
+
+/* Replaces select and read: waits up to timeout for the next answer and
+   puts what fits into the rx ring */
+static int ser_replay_fill (ser_port_t * port, int timeout) {
+    long now = bp_stats_now (), deadline = now + timeout;
+    ser_replay_in_t * in = &replay.in[replay.next];
+    unsigned int head;
+    int length, l, n = 0;
+
+    if (replay.next >= replay.scheduled || in->ready > deadline) {
+        usleep (timeout);
+        return 0;
+    }
+    if (in->ready > now)
+        usleep (in->ready - now);
+
+    length = in->chunk->length - replay.offset;
+    if (length > SERRXBUFFER - (port->rxhead - port->rxtail))
+        length = SERRXBUFFER - (port->rxhead - port->rxtail);
+    while (n < length) {
+        head = port->rxhead & (SERRXBUFFER-1);
+        l = length - n < SERRXBUFFER - head ? length - n : SERRXBUFFER - head;
+        memcpy (port->rx + head, in->chunk->data + replay.offset + n, l);
+        port->rxhead += l;
+        n += l;
+    }
+    if ((replay.offset += n) == in->chunk->length) {
+        replay.next++;
+        replay.offset = 0;
+    }
+    return n;
+}
+
+static ser_port_t * ser_port (int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return NULL;
+    if (!ports[fd] && (ports[fd] = calloc (1, sizeof (ser_port_t))))
+        ports[fd]->serialflags = -1;
+    return ports[fd];
+}
+
+static int ser_write_raw (int fd, int length, const uint8_t *buffer) {
+    int result, written = 0;
+    long start;
+
+    if (replay.active)
+        return ser_replay_write (length, buffer);
+    while (written<length) {
+        start = bp_stats_now ();
+        if ((result = write (fd, buffer+written, length-written)) == -1) {
+            perror ("serWrite/write");
+            return -1;
+        }
+        bp_stats_add (&bp_stats.write, bp_stats_now () - start);
+        bp_stats.bytesout += result;
+        ser_trace (SERTRACEOUT, buffer+written, result);
+        written += result;
+    }
+    return written;
+}
+
+/* Read whatever is available into the rx ring with a single syscall */
+static int ser_fill (int fd, ser_port_t * port) {
+    struct iovec iov[2];
+    unsigned int used = port->rxhead - port->rxtail;
+    unsigned int head = port->rxhead & (SERRXBUFFER-1);
+    int result, n = 0;
+    long start;
+
+    if (used == SERRXBUFFER)
+        return 0;
+    iov[n].iov_base = port->rx + head;
+    iov[n++].iov_len = SERRXBUFFER - used < SERRXBUFFER - head ?
+                       SERRXBUFFER - used : SERRXBUFFER - head;
+    if (head + (SERRXBUFFER - used) > SERRXBUFFER) {
+        iov[n].iov_base = port->rx;
+        iov[n++].iov_len = (head + SERRXBUFFER - used) - SERRXBUFFER;
+    }
+    start = bp_stats_now ();
+    if ((result = readv (fd, iov, n)) == -1) {
+        perror ("read");
+        return -1;
+    }
+    bp_stats_add (&bp_stats.read, bp_stats_now () - start);
+    bp_stats.bytesin += result;
+    ser_trace (SERTRACEIN, iov[0].iov_base, result < iov[0].iov_len ? result : iov[0].iov_len);
+    if (result > iov[0].iov_len)
+        ser_trace (SERTRACEIN, iov[1].iov_base, result - iov[0].iov_len);
+    port->rxhead += result;
+    return result;
+}
+
+static int ser_take (ser_port_t * port, int len, uint8_t *buf) {
+    unsigned int tail;
+    int n = 0, l;
+
+    while (n < len && port->rxhead != port->rxtail) {
+        tail = port->rxtail & (SERRXBUFFER-1);
+        l = port->rxhead - port->rxtail;
+        if (l > SERRXBUFFER - tail)
+            l = SERRXBUFFER - tail;
+        if (l > len - n)
+            l = len - n;
+        memcpy (buf+n, port->rx+tail, l);
+        port->rxtail += l;
+        n += l;
+    }
+    return n;
+}
+
 int serOpenPort (const char *devicename, tcflag_t rate) {
     int fd;
     struct termios newtio;
 
+    /* A replay needs a descriptor, but no port */
+    if (replay.active)
+        return (fd = open ("/dev/null", O_RDWR)) == -1 || !ser_port (fd) ? -1 : fd;
+
     fd = open(devicename, O_RDWR | O_NOCTTY);
     if (fd < 0) {
         perror("open");
@@ -40,7 +253,7 @@ int serOpenPort (const char *devicename, tcflag_t rate) {
 
     // set new port settings for canonical input processing
     bzero (&newtio, sizeof (newtio));
-    newtio.c_cflag = rate;
+    newtio.c_cflag = rate | CS8 | CREAD | CLOCAL;
     newtio.c_iflag = IGNPAR;
     newtio.c_cc[VMIN] = 0;
     newtio.c_cc[VTIME] = 1;
@@ -49,12 +262,92 @@ int serOpenPort (const char *devicename, tcflag_t rate) {
         perror("tcsetattr");
         return -1;
     }
+    if (!ser_port (fd)) {
+        fprintf (stderr, "Can't allocate buffers for %s\n", devicename);
+        close (fd);
+        return -1;
+    }
     return fd;
 }
 
+static int ser_latency_timer (const char *path, int value) {
+    FILE * file;
+    int result = -1;
+
+    if (!(file = fopen (path, value < 0 ? "r" : "w")))
+        return -1;
+    if (value < 0)
+        result = fscanf (file, "%d", &value) == 1 ? value : -1;
+    else
+        result = fprintf (file, "%d\n", value) > 0 ? value : -1;
+    if (fclose (file))
+        result = -1;
+    return result;
+}
+
+/* Asks for answers to be passed on right away: the latency timer of
+   usb-serial converters holds back short answers for up to 16 ms by
+   default, and ASYNC_LOW_LATENCY shortens the way through the tty layer.
+   Returns the SERLL flags of what was changed; the previous latency timer
+   is stored in oldtimer. Both are restored by serClosePort. */
+int serLowLatency (int fd, const char *devicename, int *oldtimer) {
+    ser_port_t * port;
+    struct serial_struct serial;
+    char device [PATH_MAX], * name;
+    int result = 0;
+
+    *oldtimer = -1;
+    if (replay.active || !(port = ser_port (fd)))
+        return 0;
+
+    if (realpath (devicename, device) && (name = strrchr (device, '/'))) {
+        snprintf (port->timerpath, sizeof (port->timerpath),
+                  "/sys/class/tty/%s/device/latency_timer", name+1);
+        if ((*oldtimer = ser_latency_timer (port->timerpath, -1)) > SERLATENCYTIMER &&
+            ser_latency_timer (port->timerpath, SERLATENCYTIMER) == SERLATENCYTIMER) {
+            port->timer = *oldtimer;
+            result |= SERLLTIMER;
+        } else {
+            port->timerpath[0] = 0;
+        }
+    }
+
+    if (!ioctl (fd, TIOCGSERIAL, &serial) && !(serial.flags & ASYNC_LOW_LATENCY)) {
+        port->serialflags = serial.flags;
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (!ioctl (fd, TIOCSSERIAL, &serial))
+            result |= SERLLASYNC;
+        else
+            port->serialflags = -1;
+    }
+    return result;
+}
+
+int serClosePort (int fd) {
+    struct serial_struct serial;
+
+    serFlush (fd);
+    if (fd >= 0 && fd < FD_SETSIZE && ports[fd]) {
+        if (ports[fd]->timerpath[0])
+            ser_latency_timer (ports[fd]->timerpath, ports[fd]->timer);
+        if (ports[fd]->serialflags != -1 && !ioctl (fd, TIOCGSERIAL, &serial)) {
+            serial.flags = ports[fd]->serialflags;
+            ioctl (fd, TIOCSSERIAL, &serial);
+        }
+        free (ports[fd]);
+        ports[fd] = NULL;
+    }
+    return close (fd);
+}
+
 int serSetSpeed (int fd, tcflag_t newrate) {
    struct termios tio;
 
+   /* Everything queued so far belongs to the old rate */
+   if (serFlush (fd) == -1 || (!replay.active && tcdrain (fd)))
+       return -1;
+   if (replay.active)
+       return 0;
    if (tcgetattr(fd, &tio)) {
        perror("tcgetattr");
        return -1;
@@ -79,33 +372,72 @@ int serRead (int fd, int len, uint8_t *buf) {
 }
 
 int serReadTimed (int fd, int timeout, int len, uint8_t *buf) {
-    fd_set set;
-    struct timeval tv;
+    ser_port_t * port;
     int total = 0, result;
+    long start;
 
-    do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout / 1000000;
-        tv.tv_usec = timeout % 1000000;
-        result = select (fd + 1, &set, NULL, NULL, &tv);
+    if (!(port = ser_port (fd)))
+        return -1;
+    /* Whoever waits for an answer needs the question to be sent first */
+    if (serFlush (fd) == -1)
+        return -1;
+    if ((total = ser_take (port, len, buf)) == len)
+        return total;
+
+    start = bp_stats_now ();
+    while (total < len && replay.active) {
+        if ((result = ser_replay_fill (port, timeout)) == -1)
+            return -1;
+        if (!result) {
+            bp_stats_add (&bp_stats.wait, bp_stats_now () - start);
+            return total;
+        }
+        total += ser_take (port, len-total, buf+total);
+    }
+    while (total < len) {
+        /* Yields to the event loop when running as one of its sessions */
+        result = bp_wait_readable (fd, timeout);
         switch (result) {
         case -1: // Error
-            perror ("select");
             return -1;
         case 0: // Timeout
+            bp_stats_add (&bp_stats.wait, bp_stats_now () - start);
             return total;
         case 1: // Data available
-            if ((result = read (fd, buf+total, len-total)) == -1) {
-                perror ("read");
+            if (ser_fill (fd, port) == -1)
                 return -1;
-            }
-            total += result;
+            total += ser_take (port, len-total, buf+total);
         }
-    } while (total < len);
+    }
+    bp_stats_add (&bp_stats.wait, bp_stats_now () - start);
     return total;
 }
 
+/* Returns what is buffered or arrives within timeout, up to len bytes,
+   in as few reads as the port allows */
+int serReadSome (int fd, int timeout, int len, uint8_t *buf) {
+    ser_port_t * port;
+    int total, result;
+
+    if (!(port = ser_port (fd)))
+        return -1;
+    if (serFlush (fd) == -1)
+        return -1;
+    if ((total = ser_take (port, len, buf)))
+        return total;
+
+    if (replay.active) {
+        if (ser_replay_fill (port, timeout) == -1)
+            return -1;
+        return ser_take (port, len, buf);
+    }
+    if ((result = bp_wait_readable (fd, timeout)) <= 0)
+        return result;
+    if (ser_fill (fd, port) == -1)
+        return -1;
+    return ser_take (port, len, buf);
+}
+
 int serReadCharTimed (int fd, int timeout) {
     uint8_t c;
 
@@ -155,16 +487,36 @@ int serReadLine (int fd, int maxlen, char *line) {
 }
 
 int serWrite (int fd, int length, const uint8_t *buffer) {
-    int result, written = 0;
+    ser_port_t * port;
 
-    while (written<length) {
-        if ((result = write (fd, buffer+written, length-written)) == -1) {
-            perror ("serWriteLine/write");
-            return -1;
-        }
-        written += result;
-    }
-    return written;
+    if (!(port = ser_port (fd)))
+        return ser_write_raw (fd, length, buffer);
+    if (port->txlen + length > SERTXBUFFER && serFlush (fd) == -1)
+        return -1;
+    if (length > SERTXBUFFER)
+        return ser_write_raw (fd, length, buffer);
+    memcpy (port->tx + port->txlen, buffer, length);
+    port->txlen += length;
+    return length;
+}
+
+int serFlush (int fd) {
+    ser_port_t * port;
+    int length;
+
+    if (!(port = ser_port (fd)) || !port->txlen)
+        return 0;
+    length = port->txlen;
+    port->txlen = 0;
+    return ser_write_raw (fd, length, port->tx);
+}
+
+int serAvailable (int fd) {
+    ser_port_t * port;
+
+    if (!(port = ser_port (fd)))
+        return 0;
+    return port->rxhead - port->rxtail;
 }
 
 int serWriteChar (int fd, const uint8_t c) {
@@ -180,3 +532,141 @@ int serWriteLine (int fd, int flags, const char *line) {
         serReadLine(fd, sizeof(buf), buf);
     return written;
 }
+
+/* Records all traffic of the ports opened from now on into filename */
+int serTraceRecord (const char *filename) {
+    if (!(tracefile = fopen (filename, "w"))) {
+        perror (filename);
+        return -1;
+    }
+    fwrite (SERTRACEMAGIC, 1, 4, tracefile);
+    fputc (SERTRACEVERSION, tracefile);
+    tracetime = bp_stats_now ();
+    return 0;
+}
+
+static int ser_trace_read_varint (const uint8_t ** pos, const uint8_t * end, unsigned long * value) {
+    int shift = 0;
+
+    *value = 0;
+    do {
+        if (*pos >= end || shift > 56)
+            return -1;
+        *value |= (unsigned long) (**pos & 0x7f) << shift;
+        shift += 7;
+    } while (*(*pos)++ & 0x80);
+    return 0;
+}
+
+int serTraceLoad (const char *filename, ser_trace_t *trace) {
+    FILE * file;
+    const uint8_t * pos, * end;
+    unsigned long delta, length, outpos = 0;
+    long size, time = 0;
+    ser_trace_chunk_t * chunks;
+    int size_chunks = 0;
+
+    memset (trace, 0, sizeof (ser_trace_t));
+    if (!(file = fopen (filename, "r"))) {
+        perror (filename);
+        return -1;
+    }
+    if (fseek (file, 0, SEEK_END) || (size = ftell (file)) < 5 || fseek (file, 0, SEEK_SET) ||
+        !(trace->data = malloc (size)) || fread (trace->data, 1, size, file) != size) {
+        fprintf (stderr, "Can't read trace %s\n", filename);
+        fclose (file);
+        serTraceFree (trace);
+        return -1;
+    }
+    fclose (file);
+    if (memcmp (trace->data, SERTRACEMAGIC, 4) || trace->data[4] != SERTRACEVERSION) {
+        fprintf (stderr, "%s is not a serial trace\n", filename);
+        serTraceFree (trace);
+        return -1;
+    }
+
+    pos = trace->data + 5;
+    end = trace->data + size;
+    while (pos < end) {
+        if (trace->count == size_chunks) {
+            size_chunks = size_chunks ? 2*size_chunks : 256;
+            if (!(chunks = realloc (trace->chunks, size_chunks * sizeof (ser_trace_chunk_t))))
+                goto broken;
+            trace->chunks = chunks;
+        }
+        chunks = &trace->chunks[trace->count];
+        chunks->dir = *pos++;
+        if (chunks->dir > SERTRACEIN ||
+            ser_trace_read_varint (&pos, end, &delta) ||
+            ser_trace_read_varint (&pos, end, &length) ||
+            length > end - pos)
+            goto broken;
+        time += delta;
+        chunks->time = time;
+        chunks->length = length;
+        chunks->data = (uint8_t *) pos;
+        chunks->outpos = outpos;
+        if (chunks->dir == SERTRACEOUT)
+            outpos += length;
+        pos += length;
+        trace->count++;
+    }
+    return 0;
+
+broken:
+    fprintf (stderr, "Trace %s is broken\n", filename);
+    serTraceFree (trace);
+    return -1;
+}
+
+void serTraceFree (ser_trace_t *trace) {
+    free (trace->chunks);
+    free (trace->data);
+    memset (trace, 0, sizeof (ser_trace_t));
+}
+
+/* Ports opened from now on are served from the trace in filename */
+int serTraceReplay (const char *filename) {
+    ser_trace_t * trace = &replay.trace;
+    long last = 0;
+    int i;
+
+    if (serTraceLoad (filename, trace))
+        return -1;
+    replay.in = malloc (trace->count * sizeof (ser_replay_in_t));
+    replay.out = malloc (trace->count ? trace->chunks[trace->count-1].outpos +
+                                        trace->chunks[trace->count-1].length : 1);
+    if (!replay.in || !replay.out) {
+        serTraceFree (trace);
+        return -1;
+    }
+    for (i=0; i<trace->count; i++) {
+        if (trace->chunks[i].dir == SERTRACEOUT) {
+            memcpy (replay.out + replay.outlen, trace->chunks[i].data, trace->chunks[i].length);
+            replay.outlen += trace->chunks[i].length;
+            last = trace->chunks[i].time;
+        } else {
+            replay.in[replay.incount].chunk = &trace->chunks[i];
+            replay.in[replay.incount++].gap = trace->chunks[i].time - last;
+        }
+    }
+    replay.active = 1;
+    /* Answers received before anything was sent */
+    ser_replay_schedule ();
+    return 0;
+}
+
+void serTraceClose (void) {
+    if (tracefile)
+        fclose (tracefile);
+    tracefile = NULL;
+    if (replay.active) {
+        if (!replay.diverged && replay.outpos < replay.outlen)
+            fprintf (stderr, "Replay stopped %lu bytes before the end of the trace.\n",
+                     replay.outlen - replay.outpos);
+        free (replay.in);
+        free (replay.out);
+        serTraceFree (&replay.trace);
+        memset (&replay, 0, sizeof (replay));
+    }
+}
@@ -27,14 +27,50 @@ enum serWriteLineFlags {
     SWLFCECHO = 1             /* Cancel echoed chracters by reading back the sent line */
 };
 
+#define SERLATENCYTIMER 1     /* ms, the lowest latency timer of usb-serial converters */
+
+enum serLowLatencyFlags {
+    SERLLTIMER = 1,           /* latency_timer lowered through sysfs */
+    SERLLASYNC = 2            /* ASYNC_LOW_LATENCY set */
+};
+
+enum serTraceDirs {
+    SERTRACEOUT,
+    SERTRACEIN
+};
+
+typedef struct ser_trace_chunk_s {
+    int dir;
+    long time;                /* us since the start of the trace */
+    int length;
+    uint8_t *data;
+    unsigned long outpos;     /* Bytes written before this chunk */
+} ser_trace_chunk_t;
+
+typedef struct ser_trace_s {
+    ser_trace_chunk_t *chunks;
+    int count;
+    uint8_t *data;
+} ser_trace_t;
+
 int serOpenPort (const char *devicename, tcflag_t rate);
+int serClosePort (int fd);
 int serSetSpeed (int fd, tcflag_t newrate);
 int serRead (int fd, int len, uint8_t *buf);
 int serReadTimed (int fd, int timeout, int len, uint8_t *buf);
+int serReadSome (int fd, int timeout, int len, uint8_t *buf);
 int serReadCharTimed (int fd, int timeout);
 int serReadLine (int fd, int maxlen, char *line);
 int serWrite (int fd, int length, const uint8_t *buffer);
 int serWriteChar (int fd, const uint8_t c);
 int serWriteLine (int fd, int flags, const char *line);
+int serFlush (int fd);
+int serAvailable (int fd);
+int serLowLatency (int fd, const char *devicename, int *oldtimer);
+int serTraceRecord (const char *filename);
+int serTraceReplay (const char *filename);
+int serTraceLoad (const char *filename, ser_trace_t *trace);
+void serTraceFree (ser_trace_t *trace);
+void serTraceClose (void);
 
 #endif
@@ -26,23 +26,39 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "serial.h"
 #include "buspirate.h"
+#include "bploop.h"
 #include "spitool_cmdline.h"
-
-static bp_state_t bp = {
+#include "spitool_plan.h"
+#include "spitool_daemon.h"
+#include "bpstats.h"
+#include "spitool_calibrate.h"
+#include "spitool_gang.h"
+#include "spitool_devices.h"
+#include "spitool_sniff.h"
+#include "spitool_decode.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+static const bp_state_t bp_defaults = {
     .speed = 1000,
     .devicename = "/dev/ttyUSB0",
     .devicerate = B115200,
+    .depth = BPSPIQUEUEDEPTH,
     .flags = BPSPICFGAUX | BPSPICFGOUTPUT | BPSPICFGPOWER | BPSPICFGCLOCKEDGE
 };
 
-static void hexdump (int length, uint8_t * buffer) {
+static void hexdump (uint32_t offset, int length, uint8_t * buffer) {
     int i, j;
 
     for (i=0; i<length; i+=16) {
-        printf ("%08X: ", i);
+        printf ("%08X: ", offset+i);
         for (j=0; i+j<length && j<16; j++)
             printf ("%02X ", buffer[i+j]);
         if (j<16)
@@ -55,103 +71,215 @@ static void hexdump (int length, uint8_t * buffer) {
 }
 
 
-static int _spitool_verify (bp_state_t * bp, spitool_action_t * action, uint8_t * buffer) {
-    int result;
+static const char * _spitool_typename (spitool_action_t * action) {
+    return action->device.flags & BPDFFLASH ? "flash" : "EEPROM";
+}
+
+/* Hands the device content in [addr, addr+length) to consumer chunk by chunk */
+static int _spitool_read_stream (bp_state_t * bp, spitool_action_t * action, uint32_t addr, uint32_t length,
+                                 bp_spi_chunk_t consumer, void * ctx) {
+    if (action->device.flags & BPDFFLASH)
+        return bp_spi_flash_stream (bp, addr, length, action->device.addresslength, consumer, ctx);
+    return bp_spi_eeprom_stream (bp, addr, length, action->device.addresslength, consumer, ctx);
+}
+
+static FILE * _spitool_open_file (spitool_action_t * action) {
+    FILE * infile;
 
-    printf ("Verifying EEPROM..."); fflush (stdout);
-    switch ((result = bp_spi_eeprom_verify (bp, action->start, action->length,
-                                            action->device.addresslength, buffer))) {
-    case 0: printf (" Successfully verified.\n"); break;
-    case 1: printf (" Difference encountered.\n"); break;
-    default: printf (" Error occured.\n"); break;
+    if (!strcmp (action->filename, "-"))
+        return stdin;
+    if (!(infile = fopen (action->filename, "r"))) {
+        fprintf (stderr, "Can't open file %s", action->filename);
+        perror ("");
     }
+    return infile;
+}
 
-    return result;
+static void _spitool_close_file (FILE * infile) {
+    if (infile && infile != stdin)
+        fclose (infile);
 }
 
-static uint8_t * _spitool_read_eeprom (bp_state_t * bp, spitool_action_t * action) {
-    uint8_t * buffer;
+/* Reads the next length bytes of the input file. The window after it is
+   announced to the kernel, so it's read ahead while the device is busy. */
+static int _spitool_read_window (spitool_action_t * action, FILE * infile, int length, uint8_t * buffer) {
+    off_t pos;
 
-    if (!(buffer = malloc (action->length)))
-        return NULL;
+    if (fread (buffer, 1, length, infile) != length) {
+        fprintf (stderr, "Failed to read %d bytes from %s\n", length, action->filename);
+        return 1;
+    }
+    if ((pos = ftello (infile)) >= 0)
+        posix_fadvise (fileno (infile), pos, action->window, POSIX_FADV_WILLNEED);
+    return 0;
+}
 
-    printf ("Reading EEPROM...."); fflush (stdout);
-    if (bp_spi_eeprom_read (bp, action->start, action->length, action->device.addresslength,
-                            buffer)) {
-        free (buffer);
-        printf (" Error occured.\n");
-        return NULL;
+/* Turns old (NULL if unknown) into new in [addr, addr+length) with the
+   cheapest mix of erases and page programs the planner finds */
+static int _spitool_program_flash (bp_state_t * bp, spitool_action_t * action, uint32_t addr, int length,
+                                   uint8_t * old, uint8_t * new) {
+    spitool_plan_t plan;
+    spitool_plan_op_t * op;
+    int result = 0, i, pagecost;
+    int as = action->device.addresslength;
+    const char * names [] = { "sector", "32k block", "64k block", "chip" };
+
+    /* Programming a page costs the transfer, the program time and a status poll */
+    pagecost = (bp->tpp ? bp->tpp : action->device.tpp) +
+               (action->device.pagesize + 16) * bp_byte_time (bp);
+    if (spitool_plan_flash (&action->device, pagecost, addr, length, old, new, &plan)) {
+        fprintf (stderr, "Failed to plan the flash update.\n");
+        return 1;
+    }
+    if (plan.count)
+        fprintf (action->msg, "  0x%06X: %d erases, %d page programs, about %ld.%01ld s\n", addr,
+                plan.erases, plan.programs, plan.cost / 1000000, plan.cost / 100000 % 10);
+
+    for (i=0; i<plan.count && !result; i++) {
+        op = &plan.ops[i];
+        if (op->op == SPOPROGRAM) {
+            result = bp_spi_flash_program (bp, op->addr, op->length, as, action->device.pagesize,
+                                           new + op->addr - addr);
+            continue;
+        }
+        fprintf (action->msg, "  Erasing %s at 0x%06X...\n", names[op->op], op->addr); fflush (action->msg);
+        switch (op->op) {
+        case SPOERASESECTOR:  result = bp_spi_flash_erase_sector (bp, op->addr, as); break;
+        case SPOERASEBLOCK32: result = bp_spi_flash_erase_block32 (bp, op->addr, as); break;
+        case SPOERASEBLOCK64: result = bp_spi_flash_erase_block64 (bp, op->addr, as); break;
+        case SPOERASECHIP:    result = bp_spi_flash_erase_chip (bp); break;
+        }
     }
-    printf (" Done.\n");
 
-    return buffer;
+    spitool_plan_free (&plan);
+    return result;
 }
 
-static uint8_t * _spitool_read_file (bp_state_t * bp, spitool_action_t * action) {
-    uint8_t * buffer;
-    FILE * infile;
-    size_t result;
+/* A flash programmed in windows is erased a window at a time, as the
+   planner never sees the whole chip. With the content unknown everything
+   is erased either way, so chip erase can be chosen up front when it is
+   faster than the cheapest erase unit over the whole chip. */
+static int _spitool_erase_chip_first (spitool_action_t * action) {
+    const bp_device_t * device = &action->device;
+    long long units = LLONG_MAX;
 
-    if (!(buffer = malloc (action->length)))
-        return NULL;
+    if (device->tce <= 0 || action->window >= device->capacity)
+        return 0;
+    if (device->tse > 0 && device->sectorsize > 0)
+        units = MIN(units, (long long) device->capacity / device->sectorsize * device->tse);
+    if (device->tbe32 > 0)
+        units = MIN(units, (long long) device->capacity / 32768 * device->tbe32);
+    if (device->tbe64 > 0)
+        units = MIN(units, (long long) device->capacity / 65536 * device->tbe64);
+    return device->tce < units;
+}
 
-    if (!(infile = fopen (action->filename, "r"))) {
-        fprintf (stderr, "Can't open file %s", action->filename);
-        perror ("");
-        free (buffer);
-        return NULL;
+/* Writes the sectors in [addr, addr+length), only the differing bytes if
+   the old content is known */
+static int _spitool_program_eeprom (bp_state_t * bp, spitool_action_t * action, const char * verb,
+                                    uint32_t addr, int length, uint8_t * old, uint8_t * new) {
+    int result, i;
+
+    for (i=0; i<length; i+=action->device.sectorsize) {
+        if (old && !memcmp (new+i, old+i, action->device.sectorsize))
+            continue;
+        fprintf (action->msg, "  %s sector %d...", verb, (addr+i)/action->device.sectorsize); fflush (action->msg);
+        if (old)
+            result = bp_spi_eeprom_update (bp, addr+i, action->device.sectorsize,
+                                           action->device.addresslength,
+                                           action->device.pagesize, old+i, new+i);
+        else
+            result = bp_spi_eeprom_write (bp, addr+i, action->device.sectorsize,
+                                          action->device.addresslength,
+                                          action->device.pagesize, new+i);
+        if (result)
+            return result;
+        fprintf (action->msg, "\n");
     }
+    return 0;
+}
 
-    result = fread (buffer, sizeof (uint8_t), action->length, infile);
-    fclose (infile);
-    if (result != action->length) {
-        fprintf (stderr, "Failed to read %d bytes from %s\n", (int)action->length, action->filename);
-        free (buffer);
-        return NULL;
-    }
+static int _spitool_dump_hex (void * ctx, uint32_t offset, int length, uint8_t * data) {
+    hexdump (offset, length, data);
+    return 0;
+}
 
-    return buffer;
+static int _spitool_dump_file (void * ctx, uint32_t offset, int length, uint8_t * data) {
+    return fwrite (data, length, 1, (FILE *) ctx) == 1 ? 0 : 1;
 }
 
+/* Chunks are written out while the next ones are read, so memory use
+   doesn't depend on the device size */
 static int spitool_dump (bp_state_t * bp, spitool_action_t * action) {
-    uint8_t * buffer;
     FILE * outfile;
+    int result;
 
-    if (!(buffer = _spitool_read_eeprom (bp, action)))
-        return 1;
+    if (!action->filename)
+        return _spitool_read_stream (bp, action, action->start, action->length,
+                                     _spitool_dump_hex, NULL) ? 1 : 0;
 
-    if (!action->filename) {
-        hexdump (action->length, buffer);
-    } else {
-        if ((outfile = fopen (action->filename, "w+"))) {
-            fwrite (buffer, action->length, 1, outfile);
-            fclose (outfile);
-        }
+    if (!strcmp (action->filename, "-")) {
+        outfile = action->out;
+    } else if (!(outfile = fopen (action->filename, "w+"))) {
+        fprintf (stderr, "Can't open file %s", action->filename);
+        perror ("");
+        return 1;
     }
-    free (buffer);
-    return 0;
+    result = _spitool_read_stream (bp, action, action->start, action->length,
+                                   _spitool_dump_file, outfile);
+    if (fflush (outfile))
+        result = 1;
+    if (outfile != action->out)
+        fclose (outfile);
+    if (result)
+        fprintf (stderr, "Dumping %s failed.\n", _spitool_typename (action));
+    return result ? 1 : 0;
+}
+
+/* Compares each chunk read from the device with the next bytes of the file */
+static int _spitool_verify_file (void * ctx, uint32_t offset, int length, uint8_t * data) {
+    uint8_t buffer [TERMINAL_BUFFER];
+
+    if (fread (buffer, 1, length, (FILE *) ctx) != length)
+        return -1;
+    return memcmp (buffer, data, length) ? 1 : 0;
 }
 
 static int spitool_verify (bp_state_t * bp, spitool_action_t * action) {
-    uint8_t * buffer;
-    size_t result;
+    FILE * infile = NULL;
+    int result;
 
-    if (!(buffer = _spitool_read_file (bp, action)))
+    if (!action->image && !(infile = _spitool_open_file (action)))
         return 1;
 
-    result = _spitool_verify (bp, action, buffer);
+    fprintf (action->msg, "Verifying %s...", _spitool_typename (action)); fflush (action->msg);
+    if (action->image)
+        result = _spitool_read_stream (bp, action, action->start, action->length,
+                                       bp_spi_read_compare, action->image);
+    else
+        result = _spitool_read_stream (bp, action, action->start, action->length,
+                                       _spitool_verify_file, infile);
+    switch (result) {
+    case 0: fprintf (action->msg, " Successfully verified.\n"); break;
+    case 1: fprintf (action->msg, " Difference encountered.\n"); break;
+    default: fprintf (action->msg, " Error occured.\n"); break;
+    }
 
-    free (buffer);
+    _spitool_close_file (infile);
     if (result)
         return 1;
     return 0;
 }
 
+/* Works through the device a window at a time: the input file and, for
+   update and wipe, the current content are read for one window, which is
+   written and optionally verified before the next one is fetched. */
 static int spitool_program (bp_state_t * bp, spitool_action_t * action) {
-    uint8_t * buffer1 = NULL, * buffer2 = NULL;
+    uint8_t * new = NULL, * old = NULL, * data;
+    FILE * infile = NULL;
     int result = 0;
-    int i, j;
-    int update;
+    unsigned long long addr;
+    int length;
     int mode = 0;
     unsigned long wipeval = 0xff;
     const char modes[3][9] = {"Writing", "Updating", "Wiping"};
@@ -159,63 +287,74 @@ static int spitool_program (bp_state_t * bp, spitool_action_t * action) {
     if (!strcmp (action->command->commandname, "update")) mode = 1;
     else if (!strcmp (action->command->commandname, "wipe")) mode = 2;
 
-    // source file is only needed for mode 0/1 (write/update)
-    if (mode < 2 && !(buffer1 = _spitool_read_file (bp, action)))
-        return 1;
-    // current eeprom content is only needed for mode 1/2 (update/wipe)
-    if (mode > 0 && !(buffer2 = _spitool_read_eeprom (bp, action))) {
-        free (buffer1);
-        return 1;
-    }
-    if (mode == 2) {
-        buffer1 = buffer2;
-        buffer2 = NULL;
-        if (action->arg[0]) {
-            wipeval = strtoul (action->arg[0], NULL, 0);
-            if (errno || wipeval > 255) {
-                fprintf (stderr, "Parameter %s is invalid for wipe.\n", action->arg[0]);
-                return 1;
-            }
+    if (mode == 2 && action->arg && action->arg[0]) {
+        errno = 0;
+        wipeval = strtoul (action->arg[0], NULL, 0);
+        if (errno || wipeval > 255) {
+            fprintf (stderr, "Parameter %s is invalid for wipe.\n", action->arg[0]);
+            return 1;
         }
     }
 
-    printf ("%s EEPROM...\n", modes[mode]); fflush (stdout);
-    for (i=0; i<action->device.capacity; i+=action->device.sectorsize) {
-        switch (mode) {
-        case 0:
-            update = 1;
-            break;
-        case 1:
-        case 2:
-            update = 0;
-            for (j=0; j<action->device.sectorsize; j++) {
-                if (buffer1 [i+j] != ((mode == 1) ? buffer2 [i+j] : wipeval)) {
-                    if (mode == 2)
-                        memset (buffer1+i, wipeval, action->device.sectorsize);
-                    update = 1;
-                    break;
-                }
-            }
-            break;
-        }
-        if (update) {
-            printf ("  %s sector %d...", modes[mode],
-                                       i/action->device.sectorsize); fflush (stdout);
-            if ((result = bp_spi_eeprom_write (bp, i, action->device.sectorsize,
-                                               action->device.addresslength,
-                                               action->device.sectorsize, buffer1+i)))
-                break;
-            printf ("\n");
+    // source file is only needed for mode 0/1 (write/update), unless a gang read it already
+    if (mode < 2 && !action->image && !(infile = _spitool_open_file (action)))
+        return 1;
+    // current device content is only needed for mode 1/2 (update/wipe)
+    if ((!action->image && !(new = malloc (action->window))) ||
+        (mode > 0 && !(old = malloc (action->window)))) {
+        fprintf (stderr, "Out of memory.\n");
+        result = 1;
+        goto out;
+    }
+
+    fprintf (action->msg, "%s %s...\n", modes[mode], _spitool_typename (action)); fflush (action->msg);
+    /* Each window is then planned on top of the erased chip */
+    if (!mode && action->device.flags & BPDFFLASH && _spitool_erase_chip_first (action)) {
+        fprintf (action->msg, "  Erasing chip...\n"); fflush (action->msg);
+        if (!(old = malloc (action->window)) || bp_spi_flash_erase_chip (bp)) {
+            fprintf (action->msg, "Failed.\n");
+            result = 1;
+            goto out;
         }
+        memset (old, 0xff, action->window);
     }
-    if (result) printf ("Failed.\n");
-    else printf ("Done.\n");
+    for (addr=0; addr<action->device.capacity; addr+=length) {
+        length = MIN(action->window, action->device.capacity - addr);
+
+        data = new;
+        if (action->image)
+            data = action->image + addr;
+        else if (infile)
+            result = _spitool_read_window (action, infile, length, new);
+        else
+            memset (new, wipeval, length);
+        if (!result && mode > 0 &&
+            _spitool_read_stream (bp, action, addr, length, bp_spi_read_copy, old)) {
+            fprintf (action->msg, "  Reading %s at 0x%06llX failed.\n", _spitool_typename (action), addr);
+            result = 1;
+        }
+        if (result)
+            break;
 
-    if (!result && action->verify)
-        result = _spitool_verify (bp, action, buffer1);
+        if (action->device.flags & BPDFFLASH)
+            result = _spitool_program_flash (bp, action, addr, length, old, data);
+        else
+            result = _spitool_program_eeprom (bp, action, modes[mode], addr, length, old, data);
 
-    free (buffer2);
-    free (buffer1);
+        if (!result && action->verify &&
+            (result = _spitool_read_stream (bp, action, addr, length, bp_spi_read_compare, data)))
+            fprintf (action->msg, "  Verifying %s at 0x%06llX failed.\n", _spitool_typename (action), addr);
+        if (result)
+            break;
+    }
+    if (result) fprintf (action->msg, "Failed.\n");
+    else if (action->verify) fprintf (action->msg, "Done, successfully verified.\n");
+    else fprintf (action->msg, "Done.\n");
+
+out:
+    _spitool_close_file (infile);
+    free (old);
+    free (new);
     if (result)
         return 1;
     return 0;
@@ -226,14 +365,90 @@ static int spitool_rdsr (bp_state_t * bp, spitool_action_t * action) {
 
     result = bp_spi_eeprom_rdsr (bp);
     if (result >= 0) {
-        printf ("Status Register is 0x%02X\n", result);
+        fprintf (action->msg, "Status Register is 0x%02X\n", result);
         return 0;
     } else {
-        printf ("Status Register read failed.\n");
+        fprintf (action->msg, "Status Register read failed.\n");
         return 1;
     }
 }
 
+static int spitool_rdid (bp_state_t * bp, spitool_action_t * action) {
+    uint8_t id [3];
+
+    if (bp_spi_flash_rdid (bp, id)) {
+        fprintf (action->msg, "JEDEC ID read failed.\n");
+        return 1;
+    }
+    fprintf (action->msg, "JEDEC ID is %02X %02X %02X (manufacturer 0x%02X, type 0x%02X, capacity 0x%02X)\n",
+            id[0], id[1], id[2], id[0], id[1], id[2]);
+    return 0;
+}
+
+/* Probes the flash, printing what was found. Returns 0 with device
+   filled in. */
+static int _spitool_probe (bp_state_t * bp, spitool_action_t * action, bp_device_t * device) {
+    static const char * erasenames [] = { "4k", "32k", "64k", "chip" };
+    bp_device_t probed;
+    int times [4], i, result;
+
+    switch ((result = bp_spi_flash_probe (bp, device))) {
+    case 0:
+        fprintf (action->msg, "Flash described by SFDP:\n");
+        break;
+    case 1:
+        fprintf (action->msg, "Flash without SFDP, capacity from the JEDEC ID:\n");
+        break;
+    case -2:
+        fprintf (action->msg, "No SPI flash answered the JEDEC ID read.\n");
+        return 1;
+    case -3:
+        fprintf (action->msg, "The flash lacks the 4k sector erase (0x20) this tool needs.\n");
+        return 1;
+    default:
+        fprintf (action->msg, "Probing the flash failed.\n");
+        return 1;
+    }
+    /* The database knows better, the probe fills in what it left open */
+    probed = *device;
+    if (!spitool_devices_find_id (device->id, device)) {
+        fprintf (action->msg, "  JEDEC ID %06X is %s in the device database\n", device->id, device->devicename);
+        merge_device (device, &probed);
+    }
+    fprintf (action->msg, "  %llu bytes, %d address bytes, %d byte sectors, %d byte pages\n",
+             device->capacity, device->addresslength, device->sectorsize, device->pagesize);
+    fprintf (action->msg, "  page program %d us, erase", device->tpp);
+    times[0] = device->tse;
+    times[1] = device->tbe32;
+    times[2] = device->tbe64;
+    times[3] = device->tce;
+    for (i=0; i<4; i++)
+        if (times[i])
+            fprintf (action->msg, "%s %s %d us", i ? "," : "", erasenames[i], times[i]);
+        else
+            fprintf (action->msg, "%s %s n/a", i ? "," : "", erasenames[i]);
+    fprintf (action->msg, "\n");
+    return 0;
+}
+
+static int spitool_probe (bp_state_t * bp, spitool_action_t * action) {
+    bp_device_t device;
+
+    if (spitool_rdid (bp, action))
+        return 1;
+    return _spitool_probe (bp, action, &device);
+}
+
+/* -d auto: the probed geometry, where the command line gave none */
+static int spitool_probe_device (bp_state_t * bp, spitool_action_t * action) {
+    bp_device_t device;
+
+    if (_spitool_probe (bp, action, &device))
+        return 1;
+    merge_device (&action->device, &device);
+    return check_geometry (action);
+}
+
 static int spitool_wrsr (bp_state_t * bp, spitool_action_t * action) {
     unsigned long parameter;
 
@@ -249,101 +464,548 @@ static int spitool_wrsr (bp_state_t * bp, spitool_action_t * action) {
     return 0;
 }
 
+static void _spitool_sniff_cs (void * ctx, int low, long time) {
+    printf ("CS switched to %s\n", low ? "low" : "high");
+}
+
+static void _spitool_sniff_bytes (void * ctx, const uint8_t * run, size_t count) {
+    uint8_t mosi, miso;
+
+    for (; count; count--, run+=3) {
+        mosi = run[1];
+        miso = run[2];
+        printf ("'%c' %02X %3d - '%c' %02X %3d\n",
+                mosi>=32 && mosi<127 ? mosi : '.', mosi, mosi,
+                miso>=32 && miso<127 ? miso : '.', miso, miso);
+    }
+}
+
+static void _spitool_sniff_drop (void * ctx, unsigned long bytes, long time) {
+    printf ("%lu bytes dropped\n", bytes);
+}
+
+/* Prints the sniffed traffic, decoded with --decode, and with -f stores
+   the raw capture for decoding later */
 static int spitool_sniff (bp_state_t * bp, spitool_action_t * action) {
+    static const spitool_sniff_sink_t text = {
+        _spitool_sniff_cs, _spitool_sniff_bytes, _spitool_sniff_drop, NULL
+    };
+    static const char * modes [] = { "all", "low", "high" };
+    const spitool_sniff_sink_t * sink = NULL;
+    spitool_decoder_t decoder;
+    FILE * capture = NULL;
+    int mode = 1, result;
+
+    if (action->arg && action->arg[0]) {
+        for (mode=0; mode<3 && strcmp (action->arg[0], modes[mode]); mode++) ;
+        if (mode == 3) {
+            fprintf (stderr, "Parameter %s is invalid for sniff.\n", action->arg[0]);
+            return 1;
+        }
+    }
+    if (action->filename) {
+        if (!strcmp (action->filename, "-")) {
+            capture = action->out;
+        } else if (!(capture = fopen (action->filename, "w"))) {
+            perror (action->filename);
+            return 1;
+        }
+    }
+    /* The capture on stdout leaves no room for the decoded operations */
+    if (action->decode && capture != action->out) {
+        spitool_decoder_init (&decoder, stdout, action->decode, action->device.addresslength);
+        sink = &decoder.sink;
+    } else if (!capture) {
+        sink = &text;
+    }
+
+    result = spitool_sniff_capture (bp, BPSPISNIFFALL + mode, capture, sink, action->msg);
+    if (sink == &decoder.sink)
+        spitool_decoder_finish (&decoder, action->msg);
+
+    if (capture && capture != action->out && fclose (capture)) {
+        perror (action->filename);
+        result = 1;
+    }
+    return result;
+}
+
+/* Decodes a capture of sniff -f into memory operations, as text or as
+   JSON lines */
+static int spitool_decode (bp_state_t * bp, spitool_action_t * action) {
+    spitool_sniff_parser_t parser;
+    spitool_decoder_t decoder;
+    FILE * out = action->out;
     int result;
-    uint8_t buffer[2];
-    fd_set set;
-    struct termio orig, new;
 
-/*    if (!(buffer = malloc (1<<20)))
+    if (action->filename && strcmp (action->filename, "-") && !(out = fopen (action->filename, "w"))) {
+        perror (action->filename);
         return 1;
-*/
-    serWriteChar (bp->fd, BPSPISNIFFCSLO);
-    result = serReadCharTimed (bp->fd, 10000);
-    if (result == 1) {
-        ioctl (STDIN_FILENO, TCGETA, &orig);
-        ioctl (STDIN_FILENO, TCGETA, &new);
-        new.c_lflag &= ~ECHO & ~ICANON;
-        ioctl (STDIN_FILENO, TCSETA, &new);
-        result = 0;
-        printf ("Sniffing started, press any key to abort\n");
-        do {
-            FD_ZERO (&set);
-            FD_SET (bp->fd, &set);
-            FD_SET (STDIN_FILENO, &set);
-            result = select (bp->fd+1, &set, NULL, NULL, NULL);
-            if (FD_ISSET (bp->fd, &set)) {
-                result = serReadCharTimed (bp->fd, 10000);
-                switch (result) {
-                case '[':
-                    printf ("CS switched to low\n");
-                    break;
-                case ']':
-                    printf ("CS switched to high\n");
-                    break;
-                case '\\':
-                    result = serReadTimed (bp->fd, 10000, 2, buffer);
-                    printf ("'%c' %02X %3d - '%c' %02X %3d\n",
-                            buffer[0]>=32 && buffer[0]<127 ? buffer[0] : '.', buffer[0], buffer[0],
-                            buffer[1]>=32 && buffer[1]<127 ? buffer[1] : '.', buffer[1], buffer[1]);
-                    break;
-                }
-                fflush (stdout);
-            }
-        } while (result >= 0 && !FD_ISSET (STDIN_FILENO, &set));
-        serWriteChar (bp->fd, 0);
-        getchar ();
-        ioctl (STDIN_FILENO, TCSETA, &orig);
-        if (result >= 0)
-            result = 0;
-        else
-            result = 1;
-    } else {
+    }
+    spitool_decoder_init (&decoder, out, action->decode ? action->decode : SDFTEXT,
+                          action->device.addresslength);
+    spitool_sniff_parser_init (&parser, &decoder.sink);
+
+    result = spitool_sniff_replay (action->arg[0], &parser, action->msg);
+    spitool_decoder_finish (&decoder, action->msg);
+    if (parser.junk)
+        fprintf (action->msg, "  %llu bytes outside of frames\n", parser.junk);
+
+    if (out != action->out && fclose (out)) {
+        perror (action->filename);
         result = 1;
     }
-//    free (buffer);
+    return result;
+}
 
-    if (result == 0)
+static int spitool_daemon (bp_state_t * bp, spitool_action_t * action);
+
+#define SPITOOLCALSAMPLE 4096 // Bytes per calibration read
+#define SPITOOLCALREADS 3     // Reads per setting, compared with each other
+
+/* Brings the bus pirate back to 115200 with a reset, which is only
+   understood at the rate it is running at */
+static int _spitool_calibrate_reset (bp_state_t * bp) {
+    bp_mode (bp, BPMTERMINAL);
+    if (serSetSpeed (bp->fd, B115200))
+        return 1;
+    bp->devicerate = B115200;
+    bp->mode = BPMUNKNOWN;
+    return bp_reset (bp);
+}
+
+/* The baud rate menu goes on from 115200. A failed rate change may leave
+   the bus pirate at the attempted rate waiting for the space, so it is
+   reset there: 1 if the bus pirate is back, -1 if it is lost. */
+static int _spitool_calibrate_rate (bp_state_t * bp, tcflag_t rate) {
+    char buffer [256];
+
+    if (_spitool_calibrate_reset (bp))
+        return -1;
+    if (!bp_set_rate (bp, rate))
         return 0;
-    else
+    if (serSetSpeed (bp->fd, rate))
+        return -1;
+    bp->devicerate = rate;
+    serWriteLine (bp->fd, 0, " #\n");
+    bp_sleep (20000);
+    while (serReadLine (bp->fd, sizeof (buffer), buffer) >= 0) ;
+    bp->mode = BPMTERMINAL;
+    return _spitool_calibrate_reset (bp) ? -1 : 1;
+}
+
+/* Reads the start of the device with every serial rate and SPI clock. The
+   fastest setting whose reads all succeeded with the same data is kept
+   and stored in the calibration cache. */
+static int spitool_calibrate (bp_state_t * bp, spitool_action_t * action) {
+    int length = MIN(action->device.capacity, SPITOOLCALSAMPLE);
+    uint8_t * first, * buffer;
+    int r, s, i, result, errors, bestrate = -1, bestspeed = -1;
+    long start, throughput, best = 0;
+    tcflag_t rate;
+
+    first = malloc (length);
+    buffer = malloc (length);
+    if (!first || !buffer) {
+        free (first);
+        free (buffer);
         return 1;
+    }
+
+    fprintf (action->msg, "Calibrating with %d reads of %d bytes per setting.\n", SPITOOLCALREADS, length);
+    fprintf (action->msg, "    bps    kHz  bytes/s  errors\n");
+    for (r=0; r<SPITOOLCALRATES; r++) {
+        if ((result = _spitool_calibrate_rate (bp, spitool_cal_rates[r]))) {
+            fprintf (action->msg, "%7d  serial rate setup failed\n", spitool_cal_bps[r]);
+            if (result > 0)
+                continue;
+            fprintf (action->msg, "The bus pirate did not come back, stopping.\n");
+            break;
+        }
+        for (s=0; s<SPITOOLCALSPEEDS; s++) {
+            bp->speed = s;
+            if (bp_spi_enter (bp)) {
+                fprintf (action->msg, "%7d %5d  SPI setup failed\n", spitool_cal_bps[r], spitool_cal_khz[s]);
+                continue;
+            }
+            errors = 0;
+            start = bp_stats_now ();
+            for (i=0; i<SPITOOLCALREADS; i++)
+                if (_spitool_read_stream (bp, action, 0, length, bp_spi_read_copy, i ? buffer : first) ||
+                    (i && memcmp (first, buffer, length)))
+                    errors++;
+            throughput = (long long) SPITOOLCALREADS * length * 1000000 / (bp_stats_now () - start);
+            fprintf (action->msg, "%7d %5d %8ld %7d\n", spitool_cal_bps[r], spitool_cal_khz[s], throughput, errors);
+            fflush (action->msg);
+            if (!errors && throughput > best) {
+                best = throughput;
+                bestrate = r;
+                bestspeed = s;
+            }
+        }
+    }
+    free (first);
+    free (buffer);
+
+    if (bestrate < 0) {
+        fprintf (action->msg, "No setting read the device reliably.\n");
+        return 1;
+    }
+    fprintf (action->msg, "Fastest reliable setting: %d bps, %d kHz, %ld bytes/s.\n",
+            spitool_cal_bps[bestrate], spitool_cal_khz[bestspeed], best);
+    bp->speed = bestspeed;
+    if (!_spitool_calibrate_rate (bp, spitool_cal_rates[bestrate]) && !bp_spi_enter (bp))
+        return spitool_calibration_store (bp, action, best);
+    /* The setting was measured, so it is kept even if the bus pirate is lost */
+    fprintf (action->msg, "Setting up the fastest reliable setting failed.\n");
+    rate = bp->devicerate;
+    bp->devicerate = spitool_cal_rates[bestrate];
+    spitool_calibration_store (bp, action, best);
+    bp->devicerate = rate;
+    return 1;
+}
+
+/* Converts a serial trace into Chrome's trace event format, for
+   chrome://tracing or Perfetto. Writes and reads are instant events on a
+   track each; a third track shows the time from the last write to the
+   answer. */
+static int spitool_trace2json (bp_state_t * bp, spitool_action_t * action) {
+    static const char * tracks [] = { "write", "read", "round trip" };
+    ser_trace_t trace;
+    ser_trace_chunk_t * c;
+    FILE * out = action->out;
+    long lastout = -1;
+    int i, j;
+
+    if (serTraceLoad (action->arg[0], &trace))
+        return 1;
+    if (action->filename && strcmp (action->filename, "-") && !(out = fopen (action->filename, "w"))) {
+        perror (action->filename);
+        serTraceFree (&trace);
+        return 1;
+    }
+
+    fprintf (out, "{\"traceEvents\": [\n");
+    for (i=0; i<3; i++)
+        fprintf (out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                 "\"args\": {\"name\": \"%s\"}},\n", i+1, tracks[i]);
+    for (i=0; i<trace.count; i++) {
+        c = &trace.chunks[i];
+        if (c->dir == SERTRACEIN && lastout >= 0) {
+            fprintf (out, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 3, "
+                     "\"ts\": %ld, \"dur\": %ld},\n", tracks[2], lastout, c->time - lastout);
+            lastout = -1;
+        } else if (c->dir == SERTRACEOUT) {
+            lastout = c->time;
+        }
+        fprintf (out, "{\"name\": \"%s %d\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %d, "
+                 "\"ts\": %ld, \"args\": {\"data\": \"", tracks[c->dir], c->length, c->dir+1, c->time);
+        for (j=0; j<c->length && j<32; j++)
+            fprintf (out, "%s%02X", j ? " " : "", c->data[j]);
+        fprintf (out, "%s\"}},\n", c->length > 32 ? " ..." : "");
+    }
+    /* The trace event format allows leaving out the closing bracket, but
+       not a trailing comma, so the list ends with a metadata event */
+    fprintf (out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+             "\"args\": {\"name\": \"spitool\"}}\n],\n\"displayTimeUnit\": \"ms\"}\n");
+
+    if (out != action->out)
+        fclose (out);
+    serTraceFree (&trace);
+    return 0;
 }
 
 const spitool_command_t commands [] = {
-    { "dump", spitool_dump, CFNEEDAS | CFNEEDDS },
-    { "program", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFNEEDFILE },
-    { "update", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFNEEDFILE },
-    { "wipe", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFOPTARG },
-    { "verify", spitool_verify, CFNEEDAS | CFNEEDDS | CFNEEDFILE },
+    { "dump", spitool_dump, CFNEEDAS | CFNEEDDS | CFGANG },
+    { "program", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFNEEDFILE | CFGANG },
+    { "update", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFNEEDFILE | CFGANG },
+    { "wipe", spitool_program, CFNEEDAS | CFNEEDDS | CFNEEDSS | CFOPTARG | CFGANG },
+    { "verify", spitool_verify, CFNEEDAS | CFNEEDDS | CFNEEDFILE | CFGANG },
     { "rdsr", spitool_rdsr, 0 },
     { "wrsr", spitool_wrsr, CFNEEDARG },
-    { "sniff", spitool_sniff, 0 },
+    { "rdid", spitool_rdid, 0 },
+    { "probe", spitool_probe, 0 },
+    { "sniff", spitool_sniff, CFOPTARG },
+    { "daemon", spitool_daemon, CFNEEDARG },
+    { "decode", spitool_decode, CFNEEDARG | CFNOPORT },
+    { "trace2json", spitool_trace2json, CFNEEDARG | CFNOPORT },
+    { "calibrate", spitool_calibrate, CFNEEDAS | CFNEEDDS },
     { NULL, NULL, 0 }
 };
 
+#define SPITOOLRTTPROBES 16
+
+static void spitool_lowlatency (bp_state_t * bp, spitool_action_t * action) {
+    long before, after;
+    int changed, timer;
+
+    before = bp_spi_roundtrip (bp, SPITOOLRTTPROBES);
+    changed = serLowLatency (bp->fd, bp->devicename, &timer);
+    after = bp_spi_roundtrip (bp, SPITOOLRTTPROBES);
+
+    if (changed & SERLLTIMER)
+        fprintf (action->msg, "Latency timer lowered from %d to %d ms.\n", timer, SERLATENCYTIMER);
+    else if (timer > SERLATENCYTIMER)
+        fprintf (action->msg, "Latency timer is %d ms, but can't be changed.\n", timer);
+    else if (timer >= 0)
+        fprintf (action->msg, "Latency timer is %d ms already.\n", timer);
+    else
+        fprintf (action->msg, "No latency timer found for %s.\n", bp->devicename);
+    if (changed & SERLLASYNC)
+        fprintf (action->msg, "Serial driver switched to low latency.\n");
+    fprintf (action->msg, "Round trip time %ld us before, %ld us after tuning.\n", before, after);
+}
+
+/* With the data going to stdout, messages go to stderr */
+static int spitool_redirect (spitool_action_t * action) {
+    if (action->filename && !strcmp (action->filename, "-") && action->out == stdout) {
+        if (!(action->out = fdopen (dup (STDOUT_FILENO), "w")))
+            return 1;
+        dup2 (STDERR_FILENO, STDOUT_FILENO);
+    }
+    return 0;
+}
+
+#define SPITOOLERASEMARGIN 20 // Erase timeout in typical erase times
+
+/* Starts the write engines from the part's typical times and keeps the
+   SPI clock within what it takes */
+static int spitool_apply_timing (bp_state_t * bp, spitool_action_t * action) {
+    int speed = bp->speed;
+
+    if (action->device.flags & BPDFFLASH) {
+        if (!bp->tpp)
+            bp->tpp = action->device.tpp;
+    } else if (!bp->twc) {
+        bp->twc = action->device.tpp;
+    }
+    /* Twice the maximum leaves room for the serial round trips */
+    bp->tmax = 2 * action->device.tppmax;
+    /* Erase times are typical ones, datasheets give maximums of up to 15
+       times that */
+    bp->tsemax = SPITOOLERASEMARGIN * (long) action->device.tse;
+    bp->tbe32max = SPITOOLERASEMARGIN * (long) action->device.tbe32;
+    bp->tbe64max = SPITOOLERASEMARGIN * (long) action->device.tbe64;
+    bp->tcemax = SPITOOLERASEMARGIN * (long) action->device.tce;
+
+    if (!action->device.maxkhz || action->speedset)
+        return 0;
+    while (speed > 0 && spitool_cal_khz[speed] > action->device.maxkhz)
+        speed--;
+    if (speed == bp->speed)
+        return 0;
+    fprintf (action->msg, "Lowering the SPI clock to %d kHz, the part takes %d kHz at most.\n",
+             spitool_cal_khz[speed], action->device.maxkhz);
+    bp->speed = speed;
+    return bp_spi_enter (bp);
+}
+
+static int spitool_run (bp_state_t * bp, spitool_action_t * action) {
+    long start;
+    int result = 0, addr4;
+
+    start = bp_stats_now ();
+    if (action->probe && action->command->flags & (CFNEEDAS | CFNEEDDS | CFNEEDSS))
+        result = spitool_probe_device (bp, action);
+    if (!result && !(action->command->flags & CFNOPORT) &&
+        action->command->action != spitool_calibrate && spitool_apply_timing (bp, action))
+        result = 1;
+    /* Flashes beyond 16 MB come up with 3 address bytes */
+    addr4 = !result && action->command->flags & CFNEEDAS && !(action->command->flags & CFNOPORT) &&
+            action->device.flags & BPDFFLASH && action->device.addresslength == 4;
+
+    if (addr4 && bp_spi_flash_4byte (bp, 1)) {
+        fprintf (stderr, "Entering 4 byte address mode failed.\n");
+        result = 1;
+    } else if (!result) {
+        result = action->command->action (bp, action);
+    }
+    if (addr4 && bp_spi_flash_4byte (bp, 0) && !result) {
+        fprintf (stderr, "Leaving 4 byte address mode failed.\n");
+        result = 1;
+    }
+    bp_stats_phase (BPPHCOMMAND, start);
+    if (!result)
+        fprintf (action->msg, "Command %s completed successfully.\n", action->command->commandname);
+    else
+        fprintf (action->msg, "Command %s failed.\n", action->command->commandname);
+    if (action->out != stdout)
+        fclose (action->out);
+    /* On stderr, so it never mixes with data on stdout */
+    fflush (action->msg);
+    bp_stats_print (stderr, action->stats);
+    return result;
+}
+
+/* Runs a client's command line on the daemon's session. Port options are
+   the daemon's business; SPI settings are switched when they differ. */
+static int spitool_job (void * ctx, int argc, const char ** argv) {
+    bp_state_t * bp = ctx, job = bp_defaults;
+    spitool_action_t * action;
+    long start;
+    int result = 1;
+
+    bp_stats_reset ();
+    if (!(action = parse_commandline (argc, argv, commands, &job)))
+        return 1;
+    if (action->command->action == spitool_daemon ||
+        action->command->action == spitool_calibrate || action->gang) {
+        fprintf (stderr, "Command %s can't run on a daemon.\n", action->command->commandname);
+        goto out;
+    }
+    /* The daemon's serial rate stays, but the SPI clock can follow */
+    action->rateset = 1;
+    job.devicename = bp->devicename;
+    spitool_calibration_apply (&job, action);
+    if (job.flags != bp->flags || job.speed != bp->speed) {
+        bp->flags = job.flags;
+        bp->speed = job.speed;
+        start = bp_stats_now ();
+        result = bp_spi_enter (bp);
+        bp_stats_phase (BPPHSPIENTER, start);
+        if (result) {
+            fprintf (stderr, "Reconfiguring SPI mode failed.\n");
+            goto out;
+        }
+    }
+    bp->depth = job.depth;
+    if (!(result = spitool_redirect (action)))
+        result = spitool_run (bp, action);
+
+out:
+    free (action->arg);
+    free (action);
+    return result;
+}
+
+static int spitool_daemon (bp_state_t * bp, spitool_action_t * action) {
+    fprintf (action->msg, "Serving commands on %s until interrupted.\n", action->arg[0]);
+    fflush (action->msg);
+    return spitool_serve (action->arg[0], spitool_job, bp);
+}
+
+/* Opens the bus pirate, enters SPI mode, runs the command and closes it
+   again */
+static int spitool_session (bp_state_t * bp, spitool_action_t * action) {
+    long start;
+    int result;
+
+    start = bp_stats_now ();
+    result = bp_open (bp);
+    bp_stats_phase (BPPHOPEN, start);
+    if (result)
+        return 1;
+
+    /* Versions are only known from the banner of a reset */
+    if (bp->hw_version)
+        fprintf (action->msg, "Bus Pirate %d.%d, Firmware %d.%d (r%d), Bootloader %d.%d found.\n",
+                 bp->hw_version/100, bp->hw_version%100,
+                 bp->sw_version/100, bp->sw_version%100,
+                 bp->sw_revision,
+                 bp->bl_version/100, bp->bl_version%100);
+    else
+        fprintf (action->msg, "Bus Pirate found in binary mode.\n");
+
+    start = bp_stats_now ();
+    result = bp_spi_enter (bp);
+    bp_stats_phase (BPPHSPIENTER, start);
+    if (!result) {
+        fprintf (action->msg, "Entered binary SPI mode version %d.\n", bp->bm_version);
+        if (action->lowlatency)
+            spitool_lowlatency (bp, action);
+
+        result = spitool_run (bp, action);
+
+        if (!action->keep)
+            bp_mode (bp, BPMTERMINAL);
+    }
+    serClosePort (bp->fd);
+    return result;
+}
+
+/* Reads the input file once for all ports of a gang */
+static int spitool_load_image (spitool_action_t * action) {
+    FILE * infile;
+    size_t length = action->command->action == spitool_verify ? action->length : action->device.capacity;
+    int result = 0;
+
+    if (!(infile = _spitool_open_file (action)))
+        return 1;
+    if (!(action->image = malloc (length)) || fread (action->image, 1, length, infile) != length) {
+        fprintf (stderr, "Failed to read %zu bytes from %s\n", length, action->filename);
+        free (action->image);
+        action->image = NULL;
+        result = 1;
+    }
+    _spitool_close_file (infile);
+    return result;
+}
+
+typedef struct spitool_gang_ctx_s {
+    const bp_state_t * bp;
+    const spitool_action_t * action;
+} spitool_gang_ctx_t;
+
+/* One port of the gang, with a copy of the settings of its own */
+static int spitool_gang_job (void * ctx, const char * port, FILE * log) {
+    spitool_gang_ctx_t * gang = ctx;
+    bp_state_t bp = *gang->bp;
+    spitool_action_t action = *gang->action;
+    char filename [PATH_MAX];
+    const char * name;
+    int result;
+
+    bp.devicename = (char *) port;
+    action.msg = log;
+    action.stats = BPSFNONE;
+    if (action.command->action == spitool_dump) {
+        name = strrchr (port, '/');
+        snprintf (filename, sizeof (filename), "%s.%s", action.filename, name ? name+1 : port);
+        action.filename = filename;
+    }
+    spitool_calibration_apply (&bp, &action);
+    result = spitool_session (&bp, &action);
+    bp_stats_print (log, gang->action->stats);
+    return result;
+}
+
 int main (int argc, const char ** argv) {
     spitool_action_t * action;
+    bp_state_t bp = bp_defaults;
+    spitool_gang_ctx_t gang = { &bp };
 
-    action = parse_commandline (argc, argv, commands, &bp);
+    if (!(action = parse_commandline (argc, argv, commands, &bp)))
+        return 0;
+
+    /* The daemon has the port open already and runs the command for us */
+    if (action->socket)
+        return spitool_client (action->socket, argc, argv) != 0;
 
-    if (action && !bp_open (&bp)) {
-        printf ("Bus Pirate %d.%d, Firmware %d.%d (r%d), Bootloader %d.%d found.\n",
-                bp.hw_version/100, bp.hw_version%100,
-                bp.sw_version/100, bp.sw_version%100,
-                bp.sw_revision,
-                bp.bl_version/100, bp.bl_version%100);
+    if (action->command->flags & CFNOPORT) {
+        if (!spitool_redirect (action))
+            spitool_run (&bp, action);
+        return 0;
+    }
 
-        if (bp_spi_enter (&bp))
+    if (action->gang) {
+        /* Probed ports may differ in size, so they read the file themselves */
+        if (action->command->flags & CFNEEDFILE && !action->probe && spitool_load_image (action))
             return 1;
-        printf ("Entered binary SPI mode version %d.\n", bp.bm_version);
+        gang.action = action;
+        return spitool_gang (action->gang, spitool_gang_job, &gang, action->stats != BPSFNONE) != 0;
+    }
 
-        if (!action->command->action (&bp, action))
-            printf ("Command %s completed successfully.\n", action->command->commandname);
-        else
-            printf ("Command %s failed.\n", action->command->commandname);
+    if (spitool_redirect (action))
+        return 1;
 
-        bp_mode (&bp, BPMTERMINAL);
-        close (bp.fd);
-    }
+    if (action->command->action != spitool_calibrate)
+        spitool_calibration_apply (&bp, action);
+
+    if ((action->trace && serTraceRecord (action->trace)) ||
+        (action->replay && serTraceReplay (action->replay)))
+        return 1;
+
+    spitool_session (&bp, action);
+    serTraceClose ();
     return 0;
 }
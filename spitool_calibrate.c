@@ -0,0 +1,158 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Cache of the link settings found by the calibrate command.
+ *
+ * One line per port and device type: the port's real path, the device
+ * name (ds=<capacity> for devices given by size), the serial rate in bps,
+ * the SPI clock in kHz and the read throughput measured in bytes/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "spitool_calibrate.h"
+
+#define SPITOOLCALFILE "spitool/calibration"
+#define SPITOOLCALLINE 1024
+
+const tcflag_t spitool_cal_rates [SPITOOLCALRATES] = {
+    B115200, B230400, B460800, B1000000, B2000000
+};
+const int spitool_cal_bps [SPITOOLCALRATES] = {
+    115200, 230400, 460800, 1000000, 2000000
+};
+const int spitool_cal_khz [SPITOOLCALSPEEDS] = {
+    30, 125, 250, 1000, 2000, 2600, 4000, 8000
+};
+
+/* $XDG_CACHE_HOME/file or ~/.cache/file, creating the directories on the
+   way if asked to */
+int spitool_cache_path (char * path, const char * file, int create) {
+    const char * base = getenv ("XDG_CACHE_HOME");
+    char * slash;
+    int length;
+
+    if (base && base[0])
+        length = snprintf (path, PATH_MAX, "%s/%s", base, file);
+    else if ((base = getenv ("HOME")))
+        length = snprintf (path, PATH_MAX, "%s/.cache/%s", base, file);
+    else
+        return 1;
+    if (length >= PATH_MAX)
+        return 1;
+
+    for (slash = strchr (path+1, '/'); create && slash; slash = strchr (slash+1, '/')) {
+        *slash = 0;
+        if (mkdir (path, 0755) && errno != EEXIST) {
+            perror (path);
+            return 1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+static void _spitool_cal_key (bp_state_t * bp, spitool_action_t * action, char * port, char * device) {
+    if (!realpath (bp->devicename, port))
+        snprintf (port, PATH_MAX, "%s", bp->devicename);
+    if (action->device.devicename)
+        snprintf (device, SPITOOLCALLINE, "%s", action->device.devicename);
+    else
+        snprintf (device, SPITOOLCALLINE, "ds=%llu", action->device.capacity);
+}
+
+/* Parses a cache line, returns 0 if it is for port and device */
+static int _spitool_cal_match (const char * line, const char * port, const char * device,
+                               int * rate, int * speed) {
+    char lport [SPITOOLCALLINE], ldevice [SPITOOLCALLINE];
+    int bps, khz, i;
+
+    if (sscanf (line, "%1023s %1023s %d %d", lport, ldevice, &bps, &khz) != 4 ||
+        strcmp (lport, port) || strcmp (ldevice, device))
+        return 1;
+    for (*rate=0; *rate<SPITOOLCALRATES && spitool_cal_bps[*rate] != bps; (*rate)++) ;
+    for (i=0; i<SPITOOLCALSPEEDS && spitool_cal_khz[i] != khz; i++) ;
+    *speed = i;
+    return *rate == SPITOOLCALRATES || *speed == SPITOOLCALSPEEDS;
+}
+
+/* Sets the calibrated serial rate and SPI clock for the port and device,
+   where they weren't given on the command line. Returns 0 if found. */
+int spitool_calibration_apply (bp_state_t * bp, spitool_action_t * action) {
+    char path [PATH_MAX], port [PATH_MAX], device [SPITOOLCALLINE], line [SPITOOLCALLINE];
+    FILE * file;
+    int rate, speed, found = 0;
+
+    if ((action->rateset && action->speedset) || spitool_cache_path (path, SPITOOLCALFILE, 0) ||
+        !(file = fopen (path, "r")))
+        return 1;
+    _spitool_cal_key (bp, action, port, device);
+    while (!found && fgets (line, sizeof (line), file))
+        found = !_spitool_cal_match (line, port, device, &rate, &speed);
+    fclose (file);
+    if (!found)
+        return 1;
+
+    if (!action->rateset) {
+        bp->devicerate = spitool_cal_rates[rate];
+        fprintf (action->msg, "Using the calibrated serial rate of %d bps.\n", spitool_cal_bps[rate]);
+    }
+    if (!action->speedset) {
+        bp->speed = speed;
+        fprintf (action->msg, "Using the calibrated SPI clock of %d kHz.\n", spitool_cal_khz[speed]);
+    }
+    return 0;
+}
+
+/* Replaces the entry for the port and device with bp's settings */
+int spitool_calibration_store (bp_state_t * bp, spitool_action_t * action, long throughput) {
+    char path [PATH_MAX], temp [PATH_MAX + 4], port [PATH_MAX], device [SPITOOLCALLINE];
+    char line [SPITOOLCALLINE];
+    FILE * in, * out;
+    int rate, speed;
+
+    if (spitool_cache_path (path, SPITOOLCALFILE, 1))
+        return 1;
+    snprintf (temp, sizeof (temp), "%s.new", path);
+    if (!(out = fopen (temp, "w"))) {
+        perror (temp);
+        return 1;
+    }
+    _spitool_cal_key (bp, action, port, device);
+    if ((in = fopen (path, "r"))) {
+        while (fgets (line, sizeof (line), in))
+            if (_spitool_cal_match (line, port, device, &rate, &speed))
+                fputs (line, out);
+        fclose (in);
+    }
+    for (rate=0; rate<SPITOOLCALRATES-1 && spitool_cal_rates[rate] != bp->devicerate; rate++) ;
+    fprintf (out, "%s %s %d %d %ld\n", port, device, spitool_cal_bps[rate],
+             spitool_cal_khz[bp->speed], throughput);
+    if (fclose (out) || rename (temp, path)) {
+        perror (path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_CALIBRATE_H__
+#define __SPITOOL_CALIBRATE_H__
+
+#include <termios.h>
+#include "buspirate.h"
+#include "spitool_cmdline.h"
+
+#define SPITOOLCALRATES 5     // 115200 and the extended rates of -P
+#define SPITOOLCALSPEEDS 8    // SPI clocks BPSPISPEED30K..BPSPISPEED8M
+
+extern const tcflag_t spitool_cal_rates [SPITOOLCALRATES];
+extern const int spitool_cal_bps [SPITOOLCALRATES];
+extern const int spitool_cal_khz [SPITOOLCALSPEEDS];
+
+int spitool_cache_path (char * path, const char * file, int create);
+int spitool_calibration_apply (bp_state_t * bp, spitool_action_t * action);
+int spitool_calibration_store (bp_state_t * bp, spitool_action_t * action, long throughput);
+
+#endif
@@ -22,16 +22,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "buspirate.h"
 #include "spitool_cmdline.h"
+#include "bpstats.h"
+#include "spitool_devices.h"
+#include "spitool_decode.h"
 
 static const bp_device_t spi_devices [] = {
     { "list",        0, 0,  0, 0, BPDFDUMMY },
     { "M95160*",  2048, 2, 32, 0, BPDFEEPROM },
     { "M95320*",  4096, 2, 32, 0, BPDFEEPROM },
     { "M95640*",  8192, 2, 32, 0, BPDFEEPROM },
-    { "M95256*", 32768, 2, 32, 0, BPDFEEPROM }
+    { "M95256*", 32768, 2, 32, 0, BPDFEEPROM },
+    { "M95M02*",262144, 3, 256, 0, BPDFEEPROM },
+    { "W25Q80*",   1048576, 3, 4096, 256, BPDFFLASH, 700, 45000, 120000, 150000,  2500000 },
+    { "W25Q16*",   2097152, 3, 4096, 256, BPDFFLASH, 700, 45000, 120000, 150000,  5000000 },
+    { "W25Q32*",   4194304, 3, 4096, 256, BPDFFLASH, 700, 45000, 120000, 150000, 10000000 },
+    { "W25Q64*",   8388608, 3, 4096, 256, BPDFFLASH, 700, 45000, 120000, 150000, 20000000 },
+    { "W25Q128*", 16777216, 3, 4096, 256, BPDFFLASH, 700, 45000, 120000, 150000, 40000000 },
+    { "W25Q256*", 33554432, 4, 4096, 256, BPDFFLASH, 700, 50000, 120000, 150000, 80000000 },
+    { "W25Q512*", 67108864, 4, 4096, 256, BPDFFLASH, 700, 50000, 120000, 150000, 160000000 },
+    { "MX25L64*",  8388608, 3, 4096, 256, BPDFFLASH, 1400, 40000, 200000, 400000, 50000000 },
+    { "MX25L128*",16777216, 3, 4096, 256, BPDFFLASH, 1400, 40000, 200000, 400000, 80000000 },
+    { "MX25L256*",33554432, 4, 4096, 256, BPDFFLASH, 1400, 40000, 200000, 400000, 150000000 }
 };
 
 #ifndef ARRAY_SIZE
@@ -81,17 +96,65 @@ static int parse_flags (const char * flags, int * output) {
     return 0;
 }
 
+/* Fills in what the command line left open from a known part */
+void merge_device (bp_device_t * device, const bp_device_t * known) {
+    if (!device->capacity)
+        device->capacity = known->capacity;
+    if (!device->sectorsize)
+        device->sectorsize = known->sectorsize;
+    if (!device->addresslength)
+        device->addresslength = known->addresslength;
+    if (!device->pagesize)
+        device->pagesize = known->pagesize;
+    if (!device->flags)
+        device->flags = known->flags;
+    if (!device->tpp) {
+        device->tpp = known->tpp;
+        device->tse = known->tse;
+        device->tbe32 = known->tbe32;
+        device->tbe64 = known->tbe64;
+        device->tce = known->tce;
+        device->tppmax = known->tppmax;
+    }
+    if (!device->maxkhz)
+        device->maxkhz = known->maxkhz;
+    if (!device->id)
+        device->id = known->id;
+}
+
+/* Sizes in bytes, optionally with a k, M or G suffix */
+int parse_size (const char * arg, unsigned long long * size) {
+    char * end;
+
+    errno = 0;
+    *size = strtoull (arg, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': *size <<= 10; end++; break;
+    case 'M': *size <<= 20; end++; break;
+    case 'G': *size <<= 30; end++; break;
+    }
+    if (errno || end == arg || *end) {
+        fprintf (stderr, "Invalid size %s\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
 static int check_device (bp_device_t * device) {
+    const bp_device_t * known = NULL;
+    bp_device_t found;
     int i;
 
-    if (!device->devicename)
+    if (!device->devicename || !strcmp (device->devicename, "auto"))
         return 0;
     if (!strcmp (device->devicename, "list")) {
         printf ("Device name          Type        Capacity           Sector Size\n");
         printf ("===============================================================\n");
+        spitool_devices_list (stdout);
         for (i=0; i<ARRAY_SIZE (spi_devices); i++)
-            if (spi_devices[i].flags != BPDFDUMMY)
-                printf ("%-20s SPI %-6s, %11d bytes, %5d bytes\n",
+            if (spi_devices[i].flags != BPDFDUMMY &&
+                spitool_devices_find (spi_devices[i].devicename, &found))
+                printf ("%-20s SPI %-6s, %11llu bytes, %5d bytes\n",
                         spi_devices[i].devicename,
                         spi_devices[i].flags == BPDFEEPROM ? "EEPROM" :
                                                              "FLASH",
@@ -99,16 +162,14 @@ static int check_device (bp_device_t * device) {
         return 1;
     }
 
-    for (i=0; i<ARRAY_SIZE (spi_devices); i++)
-        if (!fnmatch (spi_devices[i].devicename, device->devicename, FNM_PATHNAME|FNM_CASEFOLD)) {
-            if (!device->capacity)
-                device->capacity = spi_devices[i].capacity;
-            if (!device->sectorsize)
-                device->sectorsize = spi_devices[i].sectorsize;
-            if (!device->addresslength)
-                device->addresslength = spi_devices[i].addresslength;
-            break;
-        }
+    /* The database comes first, so it can override the built in parts */
+    if (!spitool_devices_find (device->devicename, &found))
+        known = &found;
+    for (i=0; !known && i<ARRAY_SIZE (spi_devices); i++)
+        if (!fnmatch (spi_devices[i].devicename, device->devicename, FNM_PATHNAME|FNM_CASEFOLD))
+            known = &spi_devices[i];
+    if (known)
+        merge_device (device, known);
     return 0;
 }
 
@@ -197,6 +258,73 @@ const spitool_command_t * check_command (poptContext * context, const spitool_co
     return NULL;
 }
 
+/* Checks the device geometry the command needs and fills in what follows
+   from it. With -d auto, this waits until the device has been probed. */
+int check_geometry (spitool_action_t * action) {
+    if (action->command->flags & CFNEEDDS && !action->device.capacity) {
+        fprintf (stderr, "Command %s needs device capacity information.\n",
+                 action->command->commandname);
+        return 1;
+    }
+    /* SPI addresses are 32 bit at most */
+    if (action->device.capacity > 0xffffffffULL) {
+        fprintf (stderr, "Device size %llu is beyond what 4 address bytes reach.\n",
+                 action->device.capacity);
+        return 1;
+    }
+    if (action->device.addresslength < 0 || action->device.addresslength > 4) {
+        fprintf (stderr, "Invalid address length %d\n", action->device.addresslength);
+        return 1;
+    }
+    if (action->command->flags & CFNEEDSS && !action->device.sectorsize) {
+        fprintf (stderr, "Command %s needs device sector size information.\n",
+                 action->command->commandname);
+        return 1;
+    }
+    if (action->command->flags & CFNEEDAS && !action->device.addresslength) {
+        if (!action->device.capacity) {
+            fprintf (stderr, "Command %s needs SPI address length information, and neither length nor capacity given.\n",
+                     action->command->commandname);
+            return 1;
+        }
+        if (action->device.capacity <= 256) action->device.addresslength = 1;
+        else if (action->device.capacity <= 65536) action->device.addresslength = 2;
+        else if (action->device.capacity <= 16777216) action->device.addresslength = 3;
+        else action->device.addresslength = 4;
+    }
+
+    if (!action->device.flags)
+        action->device.flags = BPDFEEPROM;
+    /* EEPROMs write a sector at a time unless told otherwise */
+    if (!action->device.pagesize)
+        action->device.pagesize = action->device.flags & BPDFFLASH ? 256 : action->device.sectorsize;
+    if (action->device.pagesize < 0 ||
+        (action->command->flags & CFNEEDSS && !action->device.pagesize)) {
+        fprintf (stderr, "Invalid page size %d\n", action->device.pagesize);
+        return 1;
+    }
+    /* A page write goes out in one transfer with its command and address.
+       Halving keeps larger pages a multiple of what is written at once. */
+    while (action->device.pagesize > TERMINAL_BUFFER - 1 - action->device.addresslength)
+        action->device.pagesize /= 2;
+    /* Unknown flash gets common 25 series timings, without chip erase */
+    if (action->device.flags & BPDFFLASH && !action->device.tpp) {
+        action->device.tpp = 700;
+        action->device.tse = 45000;
+        action->device.tbe32 = 120000;
+        action->device.tbe64 = 150000;
+    }
+
+    if (action->length == 0)
+        action->length = action->device.capacity;
+    /* Windows hold whole sectors */
+    if (!action->window || action->window > action->device.capacity)
+        action->window = action->device.capacity;
+    if (action->device.sectorsize && action->window % action->device.sectorsize)
+        action->window += action->device.sectorsize - action->window % action->device.sectorsize;
+    return 0;
+}
+
 spitool_action_t * parse_commandline (int argc, const char ** argv,
                                       const spitool_command_t * commands,
                                       bp_state_t * bp) {
@@ -211,30 +339,61 @@ spitool_action_t * parse_commandline (int argc, const char ** argv,
           "path to bus pirate serial port's device node", "<string>" },
         { "portspeed", 'P', POPT_ARG_INT, &intarg, 'P',
           "Extended serial port speed", "<1..4>" },
+        { "keep", 'k', POPT_ARG_NONE, NULL, 'k',
+          "leave the bus pirate in binary mode, so the next start skips the reset", NULL },
+        { "lowlatency", 'L', POPT_ARG_NONE, NULL, 'L',
+          "lower the serial port's latency, restored on exit", NULL },
         { "filename", 'f', POPT_ARG_STRING, NULL, 'f',
-          "file to read/write data to", "<string>" },
+          "file to read/write data to, - for stdout", "<string>" },
 
         { "device", 'd', POPT_ARG_STRING, NULL, 'd',
-          "devicetype that is connected", "<string|list>" },
+          "devicetype that is connected, auto to probe it", "<string|list|auto>" },
         { "as", 0, POPT_ARG_INT, &intarg, 0x100,
           "device address length in bytes", "<integer>" },
-        { "ds", 0, POPT_ARG_INT, &intarg, 0x101,
-          "device size in bytes", "<integer>" },
+        { "ds", 0, POPT_ARG_STRING, NULL, 0x101,
+          "device size in bytes, k, M and G allowed", "<size>" },
         { "ss", 0, POPT_ARG_INT, &intarg, 0x102,
           "device sector size in bytes", "<integer>" },
+        { "ps", 0, POPT_ARG_INT, &intarg, 0x103,
+          "device page size in bytes", "<integer>" },
+        { "flash", 'F', POPT_ARG_NONE, NULL, 'F',
+          "device is a SPI NOR flash", NULL },
+        { "devices", 0, POPT_ARG_STRING, NULL, 0x107,
+          "device database file (default ~/.config/spitool/devices)", "<string>" },
 
         { "verify", 'v', POPT_ARG_NONE, NULL, 'v',
           "verify after write", NULL },
+        { "queuedepth", 'Q', POPT_ARG_INT, &intarg, 'Q',
+          "SPI transactions sent ahead of their answers", "<1..64>" },
+        { "window", 'W', POPT_ARG_INT, &intarg, 'W',
+          "bytes written per step, 0 for the whole device (default 65536)", "<integer>" },
+        { "stats", 0, POPT_ARG_STRING, NULL, 0x104,
+          "print timing statistics after the command", "<text|json>" },
+        { "decode", 0, POPT_ARG_STRING, NULL, 0x108,
+          "decode sniffed traffic into memory operations", "<text|json>" },
+        { "trace", 0, POPT_ARG_STRING, NULL, 0x105,
+          "record the serial traffic into a trace file", "<string>" },
+        { "replay", 0, POPT_ARG_STRING, NULL, 0x106,
+          "replay a trace file instead of using the serial port", "<string>" },
+        { "socket", 'S', POPT_ARG_STRING, NULL, 'S',
+          "run the command on the daemon listening at this socket", "<string>" },
+        { "gang", 'G', POPT_ARG_STRING, NULL, 'G',
+          "run the command on all these ports at once, comma separated, globs allowed", "<ports>" },
 
         POPT_AUTOHELP
         POPT_TABLEEND
     };
     poptContext optcon;
+    const char ** args;
+    char * stringarg;
     int c;
     char * commandlist = make_commandlist (commands, "<", ">");
 
     if (!(action = calloc (1, sizeof (spitool_action_t))))
         return NULL;
+    action->out = stdout;
+    action->msg = stdout;
+    action->window = 65536;
 
     optcon = poptGetContext (NULL, argc, argv, cmdlineopts, 0);
 
@@ -244,10 +403,15 @@ spitool_action_t * parse_commandline (int argc, const char ** argv,
     while ((c = poptGetNextOpt (optcon)) >= 0) {
         switch (c) {
         case 'a': if (parse_flags (poptGetOptArg (optcon), &bp->flags)) goto errout; break;
-        case 'c': bp->speed = intarg; break;
+        case 'c': bp->speed = intarg; action->speedset = 1; break;
         case 'd': action->device.devicename = poptGetOptArg (optcon); break;
         case 'f': action->filename = poptGetOptArg (optcon); break;
+        case 'F': action->device.flags = BPDFFLASH; break;
+        case 'k': action->keep = 1; break;
+        case 'L': action->lowlatency = 1; break;
         case 'p': bp->devicename = poptGetOptArg (optcon); break;
+        case 'S': action->socket = poptGetOptArg (optcon); break;
+        case 'G': action->gang = poptGetOptArg (optcon); break;
         case 'P': switch (intarg) {
             case 1: bp->devicerate = B230400; break;
             case 2: bp->devicerate = B460800; break;
@@ -255,11 +419,63 @@ spitool_action_t * parse_commandline (int argc, const char ** argv,
             case 4: bp->devicerate = B2000000; break;
             default: fprintf (stderr, "Invalid extended serial port speed %d\n", intarg); goto errout;
             }
+            action->rateset = 1;
             break;
         case 'v': action->verify = 1; break;
+        case 'Q':
+            if (intarg < 1 || intarg > BPSPIQUEUEMAX) {
+                fprintf (stderr, "Invalid queue depth %d\n", intarg);
+                goto errout;
+            }
+            bp->depth = intarg;
+            break;
+        case 'W':
+            if (intarg < 0) {
+                fprintf (stderr, "Invalid window size %d\n", intarg);
+                goto errout;
+            }
+            action->window = intarg;
+            break;
         case 0x100: action->device.addresslength = intarg; break;
-        case 0x101: action->device.capacity = intarg; break;
+        case 0x101:
+            stringarg = poptGetOptArg (optcon);
+            if (parse_size (stringarg, &action->device.capacity)) {
+                free (stringarg);
+                goto errout;
+            }
+            free (stringarg);
+            break;
         case 0x102: action->device.sectorsize = intarg; break;
+        case 0x103: action->device.pagesize = intarg; break;
+        case 0x104:
+            stringarg = poptGetOptArg (optcon);
+            if (!strcmp (stringarg, "text"))
+                action->stats = BPSFTEXT;
+            else if (!strcmp (stringarg, "json"))
+                action->stats = BPSFJSON;
+            else {
+                fprintf (stderr, "Invalid statistics format %s\n", stringarg);
+                free (stringarg);
+                goto errout;
+            }
+            free (stringarg);
+            break;
+        case 0x105: action->trace = poptGetOptArg (optcon); break;
+        case 0x106: action->replay = poptGetOptArg (optcon); break;
+        case 0x107: action->devices = poptGetOptArg (optcon); break;
+        case 0x108:
+            stringarg = poptGetOptArg (optcon);
+            if (!strcmp (stringarg, "text"))
+                action->decode = SDFTEXT;
+            else if (!strcmp (stringarg, "json"))
+                action->decode = SDFJSON;
+            else {
+                fprintf (stderr, "Invalid decoder format %s\n", stringarg);
+                free (stringarg);
+                goto errout;
+            }
+            free (stringarg);
+            break;
         }
     }
     if (c < -1) {
@@ -270,7 +486,8 @@ spitool_action_t * parse_commandline (int argc, const char ** argv,
         goto errout;
     }
 
-    if (check_device (&action->device) ||
+    if (spitool_devices_load (action->devices) ||
+        check_device (&action->device) ||
         check_speed (&bp->speed))
         goto errout;
 
@@ -278,49 +495,58 @@ spitool_action_t * parse_commandline (int argc, const char ** argv,
         poptPrintUsage (optcon, stderr, 0);
         goto errout;
     }
-    action->arg = poptGetArgs (optcon);
+    /* The argument vector belongs to the context, which is gone before
+       the command runs */
+    if ((args = poptGetArgs (optcon))) {
+        for (c=0; args[c]; c++) ;
+        if (!(action->arg = calloc (c+1, sizeof (char *))))
+            goto errout;
+        memcpy (action->arg, args, c * sizeof (char *));
+    }
 
-    if (action->command->flags & CFNEEDARG && (!action->arg || !action->arg[0])) {
-        fprintf (stderr, "Command %s needs an argument, but none supplied.\n",
-                 action->command->commandname);
+    if (action->trace && action->replay) {
+        fprintf (stderr, "A replay can't be traced.\n");
         goto errout;
     }
-    if (action->command->flags & CFNEEDDS && !action->device.capacity) {
-        fprintf (stderr, "Command %s needs device capacity information.\n",
-                 action->command->commandname);
-        goto errout;
+    if (action->gang) {
+        if (!(action->command->flags & CFGANG)) {
+            fprintf (stderr, "Command %s can't run on a gang.\n", action->command->commandname);
+            goto errout;
+        }
+        if (action->socket || action->trace || action->replay) {
+            fprintf (stderr, "A gang can't use a daemon, trace or replay.\n");
+            goto errout;
+        }
+        /* Each port dumps to a file of its own */
+        if (!strcmp (action->command->commandname, "dump") &&
+            (!action->filename || !strcmp (action->filename, "-"))) {
+            fprintf (stderr, "Command %s needs a filename on a gang.\n", action->command->commandname);
+            goto errout;
+        }
     }
-    if (action->command->flags & CFNEEDSS && !action->device.sectorsize) {
-        fprintf (stderr, "Command %s needs device sector size information.\n",
+    if (action->command->flags & CFNEEDARG && (!action->arg || !action->arg[0])) {
+        fprintf (stderr, "Command %s needs an argument, but none supplied.\n",
                  action->command->commandname);
         goto errout;
     }
-    if (action->command->flags & CFNEEDAS && !action->device.addresslength) {
-        if (!action->device.capacity) {
-            fprintf (stderr, "Command %s needs SPI address length information, and neither length nor capacity given.\n",
-                     action->command->commandname);
-            goto errout;
-        }
-        if (action->device.capacity < 257) action->device.addresslength = 1;
-        else if (action->device.capacity < 65537) action->device.addresslength = 2;
-        else if (action->device.capacity < 16777216) action->device.addresslength = 3;
-        else action->device.addresslength = 4;
-    }
     if (action->command->flags & CFNEEDFILE && !action->filename) {
         fprintf (stderr, "Command %s needs a filename for I/O.\n",
                  action->command->commandname);
         goto errout;
     }
-
-    if (action->length == 0)
-        action->length = action->device.capacity;
+    action->probe = action->device.devicename && !strcmp (action->device.devicename, "auto");
+    if (!action->probe && check_geometry (action))
+        goto errout;
 
     poptFreeContext(optcon);
     return action;
 
 errout:
     if (commandlist) free (commandlist);
-    if (action) free (action);
+    if (action) {
+        free (action->arg);
+        free (action);
+    }
     poptFreeContext(optcon);
     return NULL;
 }
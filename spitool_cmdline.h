@@ -20,6 +20,7 @@
 #ifndef __SPITOOL_CMDLINE_H__
 #define __SPITOOL_CMDLINE_H__
 
+#include <stdio.h>
 #include <inttypes.h>
 #include "buspirate.h"
 
@@ -29,16 +30,34 @@ enum SPITOOLCMDFLAGS {
     CFNEEDSS   = 0x0004,      // Command requires Sector Size info
     CFNEEDFILE = 0x0008,      // Command requires a filename for input/output
     CFNEEDARG  = 0x0010,      // Command requires an argument
-    CFOPTARG   = 0x0020       // Command can have (an) argument(s)
+    CFOPTARG   = 0x0020,      // Command can have (an) argument(s)
+    CFNOPORT   = 0x0040,      // Command doesn't talk to the bus pirate
+    CFGANG     = 0x0080       // Command can run on a gang of bus pirates
 };
 
 typedef struct spitool_command_s spitool_command_t;
 
 typedef struct spitool_action_s {
     char * filename;
-    int start;
-    size_t length;
+    char * socket;            // Daemon to hand the command to
+    char * trace;             // Serial trace to record
+    char * replay;            // Serial trace to replay instead of the port
+    char * gang;              // Ports to run the command on in parallel
+    char * devices;           // Device database file
+    FILE * out;               // Data output for -f -, messages then go to stderr
+    FILE * msg;               // Messages, the port's log in a gang
+    uint8_t * image;          // Input file read once for the gang, shared read-only
+    unsigned long long start;
+    unsigned long long length;
     int verify;
+    int stats;                // Statistics format printed after the command
+    int keep;                 // Leave the bus pirate in binary mode on exit
+    int lowlatency;           // Tune the serial port for short round trips
+    int rateset;              // -P given, calibration doesn't override it
+    int speedset;             // -c given, likewise
+    int probe;                // -d auto, the geometry comes from the device
+    int decode;               // Sniffed traffic decoded in this format
+    unsigned long long window; // Bytes handled per step by program, update and wipe
     const char ** arg;
     bp_device_t device;
     const spitool_command_t * command;
@@ -55,5 +74,8 @@ typedef struct spitool_command_s {
 spitool_action_t * parse_commandline (int argc, const char ** argv,
                                       const spitool_command_t * commands,
                                       bp_state_t * bp);
+int check_geometry (spitool_action_t * action);
+int parse_size (const char * arg, unsigned long long * size);
+void merge_device (bp_device_t * device, const bp_device_t * known);
 
 #endif
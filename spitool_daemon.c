@@ -0,0 +1,267 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Job server on a Unix domain socket.
+ *
+ * A job is one message with the client's command line as NUL separated
+ * strings. The client's stdin, stdout, stderr and working directory come
+ * along as file descriptors, so the job reads and writes files and prints
+ * its messages exactly as if the client ran it. The answer is the job's
+ * result as an int.
+ */
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "spitool_daemon.h"
+
+#define SPITOOLJOBFDS 4       // stdin, stdout, stderr, working directory
+
+static volatile sig_atomic_t stop;
+
+static void _spitool_stop (int signum) {
+    stop = 1;
+}
+
+static int _spitool_address (const char * path, struct sockaddr_un * addr) {
+    memset (addr, 0, sizeof (struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (addr->sun_path)) {
+        fprintf (stderr, "Socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy (addr->sun_path, path);
+    return 0;
+}
+
+static int _spitool_serve_job (int conn, spitool_job_t job, void * ctx) {
+    char data [SPITOOLMAXJOB];
+    const char * argv [SPITOOLMAXARGS + 1];
+    union {
+        char buffer [CMSG_SPACE (SPITOOLJOBFDS * sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    int fds [SPITOOLJOBFDS], saved [3];
+    int i, length, argc = 0, cwd, result;
+
+    memset (&msg, 0, sizeof (msg));
+    iov.iov_base = data;
+    iov.iov_len = sizeof (data);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof (control.buffer);
+
+    if ((length = recvmsg (conn, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+        return 1;
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN (sizeof (fds)))
+        return 1;
+    memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+    if (!(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && !data[length-1])
+        for (i=0; i<length && argc<SPITOOLMAXARGS; i+=strlen (data+i)+1)
+            argv[argc++] = data+i;
+    argv[argc] = NULL;
+
+    result = 1;
+    if (argc && (cwd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+        fflush (stdout);
+        fflush (stderr);
+        for (i=0; i<3; i++) {
+            saved[i] = dup (i);
+            dup2 (fds[i], i);
+        }
+        if (!fchdir (fds[3]))
+            result = job (ctx, argc, argv);
+        fflush (stdout);
+        fflush (stderr);
+        /* Input left over from this job's stdin must not reach the next one */
+        __fpurge (stdin);
+        clearerr (stdin);
+        for (i=0; i<3; i++) {
+            dup2 (saved[i], i);
+            close (saved[i]);
+        }
+        if (fchdir (cwd))
+            perror ("fchdir");
+        close (cwd);
+    }
+
+    for (i=0; i<SPITOOLJOBFDS; i++)
+        close (fds[i]);
+    return result;
+}
+
+/* Takes jobs from the daemon's own user and root only, in case the
+   socket's permissions were widened */
+static int _spitool_peer_check (int conn) {
+    struct ucred cred;
+    socklen_t length = sizeof (cred);
+
+    if (getsockopt (conn, SOL_SOCKET, SO_PEERCRED, &cred, &length)) {
+        perror ("SO_PEERCRED");
+        return 1;
+    }
+    if (cred.uid != geteuid () && cred.uid != 0) {
+        fprintf (stderr, "Rejected a job from uid %d.\n", (int) cred.uid);
+        return 1;
+    }
+    return 0;
+}
+
+/* Serves jobs one at a time until SIGINT or SIGTERM */
+int spitool_serve (const char * path, spitool_job_t job, void * ctx) {
+    struct sockaddr_un addr;
+    struct sigaction sa, oldint, oldterm, oldpipe;
+    struct stat st;
+    mode_t mask;
+    int sock, conn, result;
+
+    if (_spitool_address (path, &addr))
+        return 1;
+    /* A socket left over by a daemon that didn't exit cleanly */
+    if (!lstat (path, &st) && S_ISSOCK (st.st_mode))
+        unlink (path);
+    /* Jobs open files with the daemon's rights, so only its owner may
+       connect; the umask applies to the socket bind creates */
+    mask = umask (0077);
+    if ((sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1 ||
+        bind (sock, (struct sockaddr *) &addr, sizeof (addr)) ||
+        listen (sock, 4)) {
+        perror (path);
+        umask (mask);
+        if (sock != -1)
+            close (sock);
+        return 1;
+    }
+    umask (mask);
+
+    /* No SA_RESTART, so the signals interrupt accept */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = _spitool_stop;
+    sigaction (SIGINT, &sa, &oldint);
+    sigaction (SIGTERM, &sa, &oldterm);
+    sa.sa_handler = SIG_IGN;
+    sigaction (SIGPIPE, &sa, &oldpipe);
+
+    stop = 0;
+    while (!stop) {
+        if ((conn = accept4 (sock, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("accept");
+            break;
+        }
+        if (_spitool_peer_check (conn)) {
+            close (conn);
+            continue;
+        }
+        result = _spitool_serve_job (conn, job, ctx);
+        send (conn, &result, sizeof (result), 0);
+        close (conn);
+    }
+
+    sigaction (SIGINT, &oldint, NULL);
+    sigaction (SIGTERM, &oldterm, NULL);
+    sigaction (SIGPIPE, &oldpipe, NULL);
+    close (sock);
+    unlink (path);
+    return 0;
+}
+
+/* Hands the command line to the daemon and waits for the job's result,
+   -1 if the daemon couldn't be reached */
+int spitool_client (const char * path, int argc, const char ** argv) {
+    char data [SPITOOLMAXJOB];
+    union {
+        char buffer [CMSG_SPACE (SPITOOLJOBFDS * sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    int fds [SPITOOLJOBFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+    int i, length = 0, sock = -1, result = -1;
+
+    if (argc > SPITOOLMAXARGS) {
+        fprintf (stderr, "Too many arguments for the daemon.\n");
+        return -1;
+    }
+    for (i=0; i<argc; i++) {
+        if (length + strlen (argv[i]) + 1 > sizeof (data)) {
+            fprintf (stderr, "Command line too long for the daemon.\n");
+            return -1;
+        }
+        strcpy (data+length, argv[i]);
+        length += strlen (argv[i]) + 1;
+    }
+
+    if (_spitool_address (path, &addr))
+        return -1;
+    if ((fds[3] = open (".", O_RDONLY | O_DIRECTORY)) == -1 ||
+        (sock = socket (AF_UNIX, SOCK_SEQPACKET, 0)) == -1 ||
+        connect (sock, (struct sockaddr *) &addr, sizeof (addr))) {
+        perror (path);
+        goto out;
+    }
+
+    memset (&msg, 0, sizeof (msg));
+    memset (&control, 0, sizeof (control));
+    iov.iov_base = data;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof (control.buffer);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+    fflush (stdout);
+    fflush (stderr);
+    if (sendmsg (sock, &msg, 0) != length ||
+        recv (sock, &result, sizeof (result), 0) != sizeof (result)) {
+        fprintf (stderr, "Lost the connection to the daemon at %s.\n", path);
+        result = -1;
+    }
+
+out:
+    if (sock != -1)
+        close (sock);
+    if (fds[3] != -1)
+        close (fds[3]);
+    return result;
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_DAEMON_H__
+#define __SPITOOL_DAEMON_H__
+
+#define SPITOOLMAXARGS 64     // Arguments of a job's command line
+#define SPITOOLMAXJOB 4096    // Size of a job's command line
+
+/* Runs a job's command line, with stdio and the working directory set up
+   to be the client's, and returns its result */
+typedef int (*spitool_job_t) (void * ctx, int argc, const char ** argv);
+
+int spitool_serve (const char * path, spitool_job_t job, void * ctx);
+int spitool_client (const char * path, int argc, const char ** argv);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Decodes sniffed CS frames into SPI memory operations: the opcode, and
+ * where it has them the address, the number of data bytes and the status
+ * or ID read. Runs behind the live sniffer as well as over capture files,
+ * so it does little per byte and nothing per frame beyond printing it.
+ */
+
+#include <string.h>
+
+#include "spitool_decode.h"
+
+#define SPITOOLDECODELINE 128    // Longest line printed, with room to spare
+
+enum SPITOOLDECODEKINDS {
+    SDKUNKNOWN,
+    SDKPLAIN,                 // Opcode only
+    SDKERASE,                 // Address only
+    SDKREAD,                  // Address, data on MISO
+    SDKWRITE,                 // Address, data on MOSI
+    SDKRDSR,
+    SDKWRSR,
+    SDKRDID
+};
+
+typedef struct spitool_decode_op_s {
+    const char * name;
+    int kind;
+    int dummy;                // Dummy bytes after the address
+} spitool_decode_op_t;
+
+static const spitool_decode_op_t ops [256] = {
+    [0x01] = { "WRSR", SDKWRSR },
+    [0x02] = { "WRITE", SDKWRITE },
+    [0x03] = { "READ", SDKREAD },
+    [0x04] = { "WRDI", SDKPLAIN },
+    [0x05] = { "RDSR", SDKRDSR },
+    [0x06] = { "WREN", SDKPLAIN },
+    [0x0b] = { "FASTREAD", SDKREAD, 1 },
+    [0x20] = { "SE", SDKERASE },
+    [0x52] = { "BE32", SDKERASE },
+    [0x5a] = { "RDSFDP", SDKREAD, 1 },
+    [0x60] = { "CE", SDKPLAIN },
+    [0x9f] = { "RDID", SDKRDID },
+    [0xb7] = { "EN4B", SDKPLAIN },
+    [0xc7] = { "CE", SDKPLAIN },
+    [0xd8] = { "BE64", SDKERASE },
+    [0xe9] = { "EX4B", SDKPLAIN }
+};
+
+/* printf took most of the time spent on a capture, so the lines are put
+   together by hand */
+static char * _spitool_decode_str (char * p, const char * s) {
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+static char * _spitool_decode_dec (char * p, unsigned long long value, int width, char pad) {
+    char digits [20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (; width>n; width--)
+        *p++ = pad;
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+static char * _spitool_decode_hex (char * p, uint64_t value, int digits) {
+    static const char hex [] = "0123456789ABCDEF";
+
+    while (digits--)
+        *p++ = hex[(value >> (4 * digits)) & 0xf];
+    return p;
+}
+
+/* Starts a line with the time and the operation's name */
+static char * _spitool_decode_start (spitool_decoder_t * decoder, char * p, long time, const char * name) {
+    char * start;
+
+    if (decoder->format == SDFJSON) {
+        p = _spitool_decode_str (p, "{\"time_us\": ");
+        p = _spitool_decode_dec (p, time, 0, 0);
+        p = _spitool_decode_str (p, ", \"op\": \"");
+        p = _spitool_decode_str (p, name);
+        *p++ = '"';
+        return p;
+    }
+    p = _spitool_decode_dec (p, time / 1000000, 6, ' ');
+    *p++ = '.';
+    p = _spitool_decode_dec (p, time % 1000000, 6, '0');
+    *p++ = ' ';
+    start = p;
+    p = _spitool_decode_str (p, name);
+    while (p < start + 8)
+        *p++ = ' ';
+    return p;
+}
+
+/* Adds a number, as a JSON member or after a blank */
+static char * _spitool_decode_num (spitool_decoder_t * decoder, char * p, const char * name,
+                                   unsigned long long value, int hexdigits) {
+    if (decoder->format == SDFJSON) {
+        p = _spitool_decode_str (p, ", \"");
+        p = _spitool_decode_str (p, name);
+        p = _spitool_decode_str (p, "\": ");
+        return _spitool_decode_dec (p, value, 0, 0);
+    }
+    *p++ = ' ';
+    return hexdigits ? _spitool_decode_hex (p, value, hexdigits) : _spitool_decode_dec (p, value, 0, 0);
+}
+
+static void _spitool_decode_end (spitool_decoder_t * decoder, char * line, char * p, int truncated) {
+    /* The name's padding, when nothing followed it */
+    while (p[-1] == ' ')
+        p--;
+    if (truncated)
+        p = _spitool_decode_str (p, decoder->format == SDFJSON ? ", \"truncated\": true" : " (truncated)");
+    if (decoder->format == SDFJSON)
+        *p++ = '}';
+    *p++ = '\n';
+    fwrite (line, p - line, 1, decoder->out);
+}
+
+static void _spitool_decode_polls (spitool_decoder_t * decoder) {
+    char line [SPITOOLDECODELINE], * p;
+
+    if (!decoder->polls || !decoder->format) {
+        decoder->polls = 0;
+        return;
+    }
+    p = _spitool_decode_start (decoder, line, decoder->pollstart, "RDSR");
+    p = _spitool_decode_num (decoder, p, "status", decoder->pollstatus, 2);
+    if (decoder->format == SDFJSON) {
+        p = _spitool_decode_num (decoder, p, "count", decoder->polls, 0);
+    } else if (decoder->polls > 1) {
+        p = _spitool_decode_str (p, " x");
+        p = _spitool_decode_dec (p, decoder->polls, 0, 0);
+    }
+    _spitool_decode_end (decoder, line, p, 0);
+    decoder->polls = 0;
+}
+
+/* Prints the frame that just ended. truncated if data was lost in it. */
+static void _spitool_decode_frame (spitool_decoder_t * decoder, int truncated) {
+    const spitool_decode_op_t * op = &ops[decoder->opcode];
+    char line [SPITOOLDECODELINE], * p;
+    int kind = op->kind;
+
+    decoder->selected = 0;
+    if (!decoder->pos)
+        return;
+    decoder->count[decoder->opcode]++;
+    decoder->bytes[decoder->opcode] += decoder->length;
+    /* Without its address, an operation is only good for its opcode */
+    if (decoder->pos < decoder->header) {
+        kind = SDKUNKNOWN;
+        truncated = 1;
+    }
+    if (kind == SDKPLAIN && !truncated) {
+        if (decoder->opcode == 0xb7)
+            decoder->addresslength = 4;
+        else if (decoder->opcode == 0xe9)
+            decoder->addresslength = 3;
+    }
+
+    /* A busy wait is one line, however many polls it took */
+    if (kind == SDKRDSR && decoder->length && !truncated) {
+        if (decoder->polls && decoder->pollstatus == decoder->status) {
+            decoder->polls++;
+            return;
+        }
+        _spitool_decode_polls (decoder);
+        decoder->pollstart = decoder->time;
+        decoder->pollstatus = decoder->status;
+        decoder->polls = 1;
+        return;
+    }
+    _spitool_decode_polls (decoder);
+    if (!decoder->format)
+        return;
+
+    p = _spitool_decode_start (decoder, line, decoder->time, op->name ? op->name : "UNKNOWN");
+    switch (kind) {
+    case SDKUNKNOWN:
+        p = _spitool_decode_num (decoder, p, "opcode", decoder->opcode, 2);
+        if (decoder->format == SDFTEXT)
+            *p++ = ',';
+        p = _spitool_decode_num (decoder, p, "length", decoder->pos, 0);
+        if (decoder->format == SDFTEXT)
+            p = _spitool_decode_str (p, " bytes");
+        break;
+    case SDKERASE:
+    case SDKREAD:
+    case SDKWRITE:
+        if (decoder->format == SDFJSON) {
+            p = _spitool_decode_num (decoder, p, "addr", decoder->addr, 0);
+        } else {
+            p = _spitool_decode_str (p, " 0x");
+            p = _spitool_decode_hex (p, decoder->addr, 2 * (decoder->header - 1 - op->dummy));
+        }
+        if (kind != SDKERASE)
+            p = _spitool_decode_num (decoder, p, "length", decoder->length, 0);
+        break;
+    case SDKRDSR:
+    case SDKWRSR:
+        if (decoder->length)
+            p = _spitool_decode_num (decoder, p, "status",
+                                     kind == SDKRDSR ? decoder->status : decoder->mosi[0], 2);
+        break;
+    case SDKRDID:
+        if (decoder->length >= 3)
+            p = _spitool_decode_num (decoder, p, "id",
+                                     decoder->miso[0] << 16 | decoder->miso[1] << 8 | decoder->miso[2], 6);
+        break;
+    }
+    _spitool_decode_end (decoder, line, p, truncated);
+}
+
+static void _spitool_decode_cs (void * ctx, int low, long time) {
+    spitool_decoder_t * decoder = ctx;
+
+    if (decoder->selected)
+        _spitool_decode_frame (decoder, 0);
+    if (!low)
+        return;
+    decoder->selected = 1;
+    decoder->time = time;
+    decoder->pos = 0;
+    decoder->addr = 0;
+    decoder->length = 0;
+}
+
+static void _spitool_decode_bytes (void * ctx, const uint8_t * run, size_t count) {
+    spitool_decoder_t * decoder = ctx;
+    const spitool_decode_op_t * op;
+    const uint8_t * end = run + 3 * count;
+
+    if (!decoder->selected)
+        return;
+    for (; run<end && (!decoder->pos || decoder->pos < decoder->header); run+=3) {
+        if (!decoder->pos) {
+            op = &ops[run[1]];
+            decoder->opcode = run[1];
+            decoder->header = 1;
+            if (op->kind == SDKERASE || op->kind == SDKREAD || op->kind == SDKWRITE)
+                decoder->header += decoder->addresslength + op->dummy;
+        } else if (decoder->pos < decoder->header - ops[decoder->opcode].dummy) {
+            decoder->addr = decoder->addr << 8 | run[1];
+        }
+        decoder->pos++;
+    }
+    if (run == end)
+        return;
+
+    /* The data phase, by far the most bytes, only its start is kept */
+    for (; decoder->length < 3 && run<end; run+=3) {
+        decoder->mosi[decoder->length] = run[1];
+        decoder->miso[decoder->length] = run[2];
+        decoder->length++;
+        decoder->pos++;
+    }
+    decoder->length += (end - run) / 3;
+    decoder->pos += (end - run) / 3;
+    decoder->status = end[-1];
+}
+
+static void _spitool_decode_drop (void * ctx, unsigned long bytes, long time) {
+    spitool_decoder_t * decoder = ctx;
+    char line [SPITOOLDECODELINE], * p;
+
+    if (decoder->selected)
+        _spitool_decode_frame (decoder, 1);
+    _spitool_decode_polls (decoder);
+    decoder->dropped += bytes;
+    if (decoder->format == SDFNONE)
+        return;
+    p = _spitool_decode_start (decoder, line, time, "DROP");
+    p = _spitool_decode_num (decoder, p, "bytes", bytes, 0);
+    if (decoder->format == SDFTEXT)
+        p = _spitool_decode_str (p, " bytes");
+    _spitool_decode_end (decoder, line, p, 0);
+}
+
+void spitool_decoder_init (spitool_decoder_t * decoder, FILE * out, int format, int addresslength) {
+    memset (decoder, 0, sizeof (spitool_decoder_t));
+    decoder->out = out;
+    decoder->format = format;
+    decoder->addresslength = addresslength ? addresslength : 3;
+    decoder->sink.cs = _spitool_decode_cs;
+    decoder->sink.bytes = _spitool_decode_bytes;
+    decoder->sink.drop = _spitool_decode_drop;
+    decoder->sink.ctx = decoder;
+}
+
+/* Ends a frame cut off by the end of the capture and sums up */
+void spitool_decoder_finish (spitool_decoder_t * decoder, FILE * msg) {
+    int i;
+
+    if (decoder->selected)
+        _spitool_decode_frame (decoder, 1);
+    _spitool_decode_polls (decoder);
+    fflush (decoder->out);
+
+    fprintf (msg, "Operations:");
+    for (i=0; i<256; i++)
+        if (decoder->count[i]) {
+            if (ops[i].name)
+                fprintf (msg, " %s %llu", ops[i].name, decoder->count[i]);
+            else
+                fprintf (msg, " %02X %llu", i, decoder->count[i]);
+        }
+    fprintf (msg, "\n");
+    for (i=0; i<256; i++)
+        if (decoder->bytes[i] && (ops[i].kind == SDKREAD || ops[i].kind == SDKWRITE))
+            fprintf (msg, "  %-8s %llu bytes\n", ops[i].name, decoder->bytes[i]);
+    if (decoder->dropped)
+        fprintf (msg, "  %llu bytes of sniffer output dropped\n", decoder->dropped);
+}
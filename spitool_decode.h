@@ -0,0 +1,59 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_DECODE_H__
+#define __SPITOOL_DECODE_H__
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "spitool_sniff.h"
+
+enum SPITOOLDECODEFORMATS {
+    SDFNONE,
+    SDFTEXT,
+    SDFJSON                   // One JSON object per line
+};
+
+/* One CS frame being decoded */
+typedef struct spitool_decoder_s {
+    FILE * out;
+    int format;
+    int addresslength;        // Switched by EN4B and EX4B
+    int selected;
+    long time;                // When CS went low
+    int pos;                  // Bytes into the frame
+    int header;               // Opcode, address and dummy bytes
+    uint8_t opcode;
+    uint64_t addr;
+    unsigned long long length; // Bytes after the header
+    uint8_t mosi [3], miso [3]; // First bytes after the header
+    uint8_t status;           // Last status read, for RDSR
+    long pollstart;           // Consecutive RDSR polls with the same status
+    unsigned long polls;
+    uint8_t pollstatus;
+    unsigned long long count [256]; // Frames per opcode
+    unsigned long long bytes [256]; // Data bytes per opcode
+    unsigned long long dropped;
+    spitool_sniff_sink_t sink; // For the sniff parser, with the decoder as context
+} spitool_decoder_t;
+
+void spitool_decoder_init (spitool_decoder_t * decoder, FILE * out, int format, int addresslength);
+void spitool_decoder_finish (spitool_decoder_t * decoder, FILE * msg);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Device database: parts described in a text file, one per line, as a
+ * name pattern followed by key=value pairs. The parsed database is cached
+ * as a binary file that later starts map as is, until the text changes.
+ *
+ * The cache holds the records bucketed by the first character of their
+ * pattern, so a name is only matched against the patterns that can match
+ * it, and a list of the records sorted by JEDEC ID.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spitool_devices.h"
+#include "spitool_cmdline.h"
+#include "spitool_calibrate.h"
+
+#define SPITOOLDBMAGIC 0x42445053 // "SPDB"
+#define SPITOOLDBVERSION 1
+#define SPITOOLDBFILE "spitool/devices"
+#define SPITOOLDBCACHE "spitool/devices.bin"
+#define SPITOOLDBLINE 1024
+
+typedef struct spitool_db_record_s {
+    uint32_t name;            // Offset of the pattern in the strings
+    uint32_t id;
+    uint64_t capacity;
+    int32_t addresslength;
+    int32_t sectorsize;
+    int32_t pagesize;
+    int32_t flags;
+    int32_t tpp, tse, tbe32, tbe64, tce;
+    int32_t tppmax;
+    int32_t maxkhz;
+} spitool_db_record_t;
+
+/* Followed by the source path, the records, the ID index and the strings */
+typedef struct spitool_db_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordsize;
+    uint32_t count;
+    uint32_t ids;             // Records with a JEDEC ID
+    uint32_t pathsize;        // Source path with its NUL, padded to 8 bytes
+    uint64_t stringsize;
+    int64_t mtime, mtimens, size;
+    uint64_t inode;
+    uint32_t bucket [SPITOOLDBKEYS + 1]; // First record of each key
+} spitool_db_header_t;
+
+static struct {
+    char * source;            // Loaded text file, NULL without a database
+    uint8_t * data;
+    size_t size;
+    int mapped;
+    spitool_db_header_t * header;
+    spitool_db_record_t * records;
+    uint32_t * ids;
+    char * strings;
+} db;
+
+static int _spitool_db_key (const char * pattern) {
+    if (strchr ("*?[\\", pattern[0]))
+        return SPITOOLDBKEYS - 1;
+    return tolower ((unsigned char) pattern[0]);
+}
+
+static void _spitool_db_layout (void) {
+    db.header = (spitool_db_header_t *) db.data;
+    db.records = (spitool_db_record_t *) (db.data + sizeof (spitool_db_header_t) + db.header->pathsize);
+    db.ids = (uint32_t *) (db.records + db.header->count);
+    db.strings = (char *) (db.ids + db.header->ids);
+}
+
+static void _spitool_db_free (void) {
+    if (db.mapped)
+        munmap (db.data, db.size);
+    else
+        free (db.data);
+    free (db.source);
+    memset (&db, 0, sizeof (db));
+}
+
+/* Maps the cache if it was made from the text file as it is now */
+static int _spitool_db_map (const char * cache, const char * source, const struct stat * st) {
+    spitool_db_header_t * h;
+    struct stat cst;
+    void * data;
+    int fd;
+
+    if ((fd = open (cache, O_RDONLY | O_CLOEXEC)) == -1)
+        return 1;
+    if (fstat (fd, &cst) || cst.st_size < sizeof (spitool_db_header_t) ||
+        (data = mmap (NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close (fd);
+        return 1;
+    }
+    close (fd);
+
+    h = data;
+    if (h->magic != SPITOOLDBMAGIC || h->version != SPITOOLDBVERSION ||
+        h->recordsize != sizeof (spitool_db_record_t) ||
+        h->mtime != st->st_mtim.tv_sec || h->mtimens != st->st_mtim.tv_nsec ||
+        h->size != st->st_size || h->inode != st->st_ino ||
+        sizeof (spitool_db_header_t) + h->pathsize + h->count * sizeof (spitool_db_record_t) +
+        h->ids * sizeof (uint32_t) + h->stringsize != cst.st_size ||
+        strncmp ((char *) (h + 1), source, h->pathsize)) {
+        munmap (data, cst.st_size);
+        return 1;
+    }
+    db.data = data;
+    db.size = cst.st_size;
+    db.mapped = 1;
+    _spitool_db_layout ();
+    return 0;
+}
+
+/* Times in us, or with a ms or s suffix */
+static int _spitool_db_time (const char * value, int32_t * time) {
+    char * end;
+    double t;
+
+    errno = 0;
+    t = strtod (value, &end);
+    if (!strcmp (end, "ms"))
+        t *= 1000;
+    else if (!strcmp (end, "s"))
+        t *= 1000000;
+    else if (*end && strcmp (end, "us"))
+        return 1;
+    if (errno || end == value || t < 0 || t > INT32_MAX)
+        return 1;
+    *time = t;
+    return 0;
+}
+
+static int _spitool_db_int (const char * value, int32_t * number) {
+    char * end;
+    long n;
+
+    errno = 0;
+    n = strtol (value, &end, 0);
+    if (errno || end == value || *end || n < 0 || n > INT32_MAX)
+        return 1;
+    *number = n;
+    return 0;
+}
+
+static int _spitool_db_value (spitool_db_record_t * r, const char * key, const char * value) {
+    unsigned long long size;
+    int32_t id;
+
+    if (!strcmp (key, "type")) {
+        if (!strcmp (value, "eeprom"))
+            r->flags = BPDFEEPROM;
+        else if (!strcmp (value, "flash"))
+            r->flags = BPDFFLASH;
+        else
+            return 1;
+        return 0;
+    }
+    if (!strcmp (key, "size")) {
+        if (parse_size (value, &size) || size > 0xffffffffULL)
+            return 1;
+        r->capacity = size;
+        return 0;
+    }
+    if (!strcmp (key, "id")) {
+        if (_spitool_db_int (value, &id) || id > 0xffffff)
+            return 1;
+        r->id = id;
+        return 0;
+    }
+    if (!strcmp (key, "as"))
+        return _spitool_db_int (value, &r->addresslength) || r->addresslength > 4;
+    if (!strcmp (key, "sector"))
+        return _spitool_db_int (value, &r->sectorsize);
+    if (!strcmp (key, "page"))
+        return _spitool_db_int (value, &r->pagesize);
+    if (!strcmp (key, "khz"))
+        return _spitool_db_int (value, &r->maxkhz);
+    if (!strcmp (key, "tpp"))
+        return _spitool_db_time (value, &r->tpp);
+    if (!strcmp (key, "tppmax"))
+        return _spitool_db_time (value, &r->tppmax);
+    if (!strcmp (key, "tse"))
+        return _spitool_db_time (value, &r->tse);
+    if (!strcmp (key, "tbe32"))
+        return _spitool_db_time (value, &r->tbe32);
+    if (!strcmp (key, "tbe64"))
+        return _spitool_db_time (value, &r->tbe64);
+    if (!strcmp (key, "tce"))
+        return _spitool_db_time (value, &r->tce);
+    return 2;
+}
+
+/* Parses one line into r, its pattern appended to strings */
+static int _spitool_db_line (const char * filename, int lineno, char * line, spitool_db_record_t * r,
+                             char ** strings, size_t * stringsize) {
+    char * token, * value, * save, * grown;
+
+    if ((token = strchr (line, '#')))
+        *token = 0;
+    if (!(token = strtok_r (line, " \t\r\n", &save)))
+        return 1;
+
+    memset (r, 0, sizeof (spitool_db_record_t));
+    r->flags = BPDFEEPROM;
+    if (!(grown = realloc (*strings, *stringsize + strlen (token) + 1)))
+        return -1;
+    *strings = grown;
+    r->name = *stringsize;
+    strcpy (*strings + *stringsize, token);
+    *stringsize += strlen (token) + 1;
+
+    while ((token = strtok_r (NULL, " \t\r\n", &save))) {
+        if (!(value = strchr (token, '='))) {
+            fprintf (stderr, "%s:%d: %s is no key=value pair.\n", filename, lineno, token);
+            return -1;
+        }
+        *value++ = 0;
+        switch (_spitool_db_value (r, token, value)) {
+        case 1:
+            fprintf (stderr, "%s:%d: invalid %s %s\n", filename, lineno, token, value);
+            return -1;
+        case 2:
+            fprintf (stderr, "%s:%d: unknown key %s\n", filename, lineno, token);
+            return -1;
+        }
+    }
+    if (!r->capacity) {
+        fprintf (stderr, "%s:%d: %s has no size.\n", filename, lineno, *strings + r->name);
+        return -1;
+    }
+    return 0;
+}
+
+static spitool_db_record_t * _spitool_db_sort_records;
+static const char * _spitool_db_sort_strings;
+
+static int _spitool_db_cmp_key (const void * a, const void * b) {
+    uint32_t ia = *(const uint32_t *) a, ib = *(const uint32_t *) b;
+    int ka = _spitool_db_key (_spitool_db_sort_strings + _spitool_db_sort_records[ia].name);
+    int kb = _spitool_db_key (_spitool_db_sort_strings + _spitool_db_sort_records[ib].name);
+
+    /* Equal keys keep the file order, the first match wins */
+    if (ka != kb)
+        return ka - kb;
+    return ia < ib ? -1 : 1;
+}
+
+static int _spitool_db_cmp_id (const void * a, const void * b) {
+    uint32_t ia = _spitool_db_sort_records[*(const uint32_t *) a].id;
+    uint32_t ib = _spitool_db_sort_records[*(const uint32_t *) b].id;
+
+    if (ia != ib)
+        return ia < ib ? -1 : 1;
+    return *(const uint32_t *) a < *(const uint32_t *) b ? -1 : 1;
+}
+
+/* Parses the text file and lays it out like the cache */
+static int _spitool_db_parse (const char * source, const struct stat * st) {
+    FILE * file;
+    char line [SPITOOLDBLINE];
+    spitool_db_record_t * records = NULL, * grown, * sorted;
+    char * strings = NULL;
+    size_t stringsize = 0, count = 0, ids = 0, pathsize, i;
+    int lineno = 0, result = 0, key;
+    uint8_t * data;
+    spitool_db_header_t * h;
+    uint32_t * idx, * order;
+
+    if (!(file = fopen (source, "r"))) {
+        perror (source);
+        return 1;
+    }
+    while (!result && fgets (line, sizeof (line), file)) {
+        lineno++;
+        if (!(grown = realloc (records, (count+1) * sizeof (spitool_db_record_t)))) {
+            result = 1;
+            break;
+        }
+        records = grown;
+        switch (_spitool_db_line (source, lineno, line, &records[count], &strings, &stringsize)) {
+        case 0:
+            ids += records[count].id != 0;
+            count++;
+            break;
+        case -1:
+            result = 1;
+            break;
+        }
+    }
+    fclose (file);
+
+    pathsize = (strlen (source) + 8) & ~7;
+    order = result ? NULL : malloc ((count + 1) * sizeof (uint32_t));
+    if (!order || !(data = calloc (1, sizeof (spitool_db_header_t) + pathsize +
+                                      count * sizeof (spitool_db_record_t) +
+                                      ids * sizeof (uint32_t) + stringsize))) {
+        free (order);
+        free (records);
+        free (strings);
+        return 1;
+    }
+
+    h = (spitool_db_header_t *) data;
+    h->magic = SPITOOLDBMAGIC;
+    h->version = SPITOOLDBVERSION;
+    h->recordsize = sizeof (spitool_db_record_t);
+    h->count = count;
+    h->ids = ids;
+    h->pathsize = pathsize;
+    h->stringsize = stringsize;
+    h->mtime = st->st_mtim.tv_sec;
+    h->mtimens = st->st_mtim.tv_nsec;
+    h->size = st->st_size;
+    h->inode = st->st_ino;
+    strcpy ((char *) (h + 1), source);
+
+    sorted = (spitool_db_record_t *) (data + sizeof (spitool_db_header_t) + pathsize);
+    for (i=0; i<count; i++)
+        order[i] = i;
+    _spitool_db_sort_records = records;
+    _spitool_db_sort_strings = strings;
+    qsort (order, count, sizeof (uint32_t), _spitool_db_cmp_key);
+    for (i=0; i<count; i++)
+        sorted[i] = records[order[i]];
+    free (order);
+    for (i=0, key=0; key<=SPITOOLDBKEYS; key++) {
+        while (i < count && _spitool_db_key (strings + sorted[i].name) < key)
+            i++;
+        h->bucket[key] = i;
+    }
+
+    idx = (uint32_t *) (sorted + count);
+    for (i=0, ids=0; i<count; i++)
+        if (sorted[i].id)
+            idx[ids++] = i;
+    _spitool_db_sort_records = sorted;
+    qsort (idx, ids, sizeof (uint32_t), _spitool_db_cmp_id);
+    memcpy (idx + ids, strings, stringsize);
+    free (records);
+    free (strings);
+
+    db.data = data;
+    db.size = sizeof (spitool_db_header_t) + pathsize + count * sizeof (spitool_db_record_t) +
+              ids * sizeof (uint32_t) + stringsize;
+    _spitool_db_layout ();
+    return 0;
+}
+
+/* The cache is only a shortcut, failing to write it is no error */
+static void _spitool_db_store (const char * cache) {
+    char temp [PATH_MAX + 4];
+    FILE * file;
+
+    snprintf (temp, sizeof (temp), "%s.new", cache);
+    if (!(file = fopen (temp, "w")))
+        return;
+    if (fwrite (db.data, db.size, 1, file) != 1) {
+        fclose (file);
+        unlink (temp);
+        return;
+    }
+    if (fclose (file) || rename (temp, cache))
+        unlink (temp);
+}
+
+static int _spitool_db_config_path (char * path) {
+    const char * base = getenv ("XDG_CONFIG_HOME");
+
+    if (base && base[0])
+        return snprintf (path, PATH_MAX, "%s/%s", base, SPITOOLDBFILE) >= PATH_MAX;
+    if ((base = getenv ("HOME")))
+        return snprintf (path, PATH_MAX, "%s/.config/%s", base, SPITOOLDBFILE) >= PATH_MAX;
+    return 1;
+}
+
+/* Loads the database from filename, or from $XDG_CONFIG_HOME/spitool/devices
+   if that exists. A database already loaded from the same file stays. */
+int spitool_devices_load (const char * filename) {
+    char config [PATH_MAX], source [PATH_MAX], cache [PATH_MAX];
+    struct stat st;
+
+    if (!filename) {
+        if (_spitool_db_config_path (config) || access (config, F_OK))
+            return 0;
+        filename = config;
+    }
+    if (!realpath (filename, source) || stat (source, &st)) {
+        perror (filename);
+        return 1;
+    }
+    if (db.source && !strcmp (db.source, source) &&
+        db.header->mtime == st.st_mtim.tv_sec && db.header->mtimens == st.st_mtim.tv_nsec &&
+        db.header->size == st.st_size && db.header->inode == st.st_ino)
+        return 0;
+    _spitool_db_free ();
+
+    if (spitool_cache_path (cache, SPITOOLDBCACHE, 0) || _spitool_db_map (cache, source, &st)) {
+        if (_spitool_db_parse (source, &st))
+            return 1;
+        if (!spitool_cache_path (cache, SPITOOLDBCACHE, 1))
+            _spitool_db_store (cache);
+    }
+    if (!(db.source = strdup (source))) {
+        _spitool_db_free ();
+        return 1;
+    }
+    return 0;
+}
+
+static void _spitool_db_device (const spitool_db_record_t * r, bp_device_t * device) {
+    device->devicename = db.strings + r->name;
+    device->capacity = r->capacity;
+    device->addresslength = r->addresslength;
+    device->sectorsize = r->sectorsize;
+    device->pagesize = r->pagesize;
+    device->flags = r->flags;
+    device->tpp = r->tpp;
+    device->tse = r->tse;
+    device->tbe32 = r->tbe32;
+    device->tbe64 = r->tbe64;
+    device->tce = r->tce;
+    device->tppmax = r->tppmax;
+    device->maxkhz = r->maxkhz;
+    device->id = r->id;
+}
+
+static int _spitool_db_match (int key, const char * name, bp_device_t * device) {
+    uint32_t i;
+
+    for (i=db.header->bucket[key]; i<db.header->bucket[key+1]; i++)
+        if (!fnmatch (db.strings + db.records[i].name, name, FNM_PATHNAME|FNM_CASEFOLD)) {
+            _spitool_db_device (&db.records[i], device);
+            return 0;
+        }
+    return 1;
+}
+
+/* Returns 0 with device filled in if a pattern matches name */
+int spitool_devices_find (const char * name, bp_device_t * device) {
+    if (!db.source || !name[0])
+        return 1;
+    return _spitool_db_match (tolower ((unsigned char) name[0]), name, device) &&
+           _spitool_db_match (SPITOOLDBKEYS - 1, name, device);
+}
+
+int spitool_devices_find_id (uint32_t id, bp_device_t * device) {
+    uint32_t low = 0, high, mid;
+
+    if (!db.source || !id)
+        return 1;
+    /* The first record with the ID, as the file listed it first */
+    high = db.header->ids;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (db.records[db.ids[mid]].id < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == db.header->ids || db.records[db.ids[low]].id != id)
+        return 1;
+    _spitool_db_device (&db.records[db.ids[low]], device);
+    return 0;
+}
+
+void spitool_devices_list (FILE * out) {
+    bp_device_t device;
+    uint32_t i;
+
+    for (i=0; db.source && i<db.header->count; i++) {
+        _spitool_db_device (&db.records[i], &device);
+        fprintf (out, "%-20s SPI %-6s, %11llu bytes, %5d bytes\n", device.devicename,
+                 device.flags == BPDFEEPROM ? "EEPROM" : "FLASH",
+                 device.capacity, device.sectorsize);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_DEVICES_H__
+#define __SPITOOL_DEVICES_H__
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "buspirate.h"
+
+#define SPITOOLDBKEYS 257     // Lowered first character of a pattern, 256 for wildcards
+
+int spitool_devices_load (const char * filename);
+int spitool_devices_find (const char * name, bp_device_t * device);
+int spitool_devices_find_id (uint32_t id, bp_device_t * device);
+void spitool_devices_list (FILE * out);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Gang mode: the same command on several bus pirates at once, each port
+ * a session on one event loop (see bploop.c).
+ *
+ * Every port's messages are collected in a log of its own. When a port
+ * is done, a line with its result is printed, followed by the log if it
+ * failed (or always, if verbose), so the output of the ports never mixes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+
+#include "spitool_gang.h"
+#include "bploop.h"
+#include "bpstats.h"
+
+typedef struct spitool_gang_port_s {
+    const char * port;
+    spitool_gang_job_t job;
+    void * ctx;
+    int verbose;
+    int result;
+    long start;
+    char * log;
+    size_t length;
+    FILE * out;
+} spitool_gang_port_t;
+
+/* Prints the log indented below the port's result line */
+static void _spitool_gang_report (spitool_gang_port_t * p, long us, char * log, size_t length) {
+    char * line, * next;
+
+    printf ("%-24s %-6s %5ld.%01ld s\n", p->port, p->result ? "FAILED" : "ok",
+            us / 1000000, us / 100000 % 10);
+    if (p->result || p->verbose)
+        for (line = log; line && line < log + length; line = next) {
+            if ((next = memchr (line, '\n', log + length - line)))
+                next++;
+            printf ("    %.*s%s", (int) ((next ? next : log + length) - line), line, next ? "" : "\n");
+        }
+    fflush (stdout);
+}
+
+static int _spitool_gang_session (void * ctx) {
+    spitool_gang_port_t * p = ctx;
+
+    return p->job (p->ctx, p->port, p->out);
+}
+
+static void _spitool_gang_done (void * ctx, int result) {
+    spitool_gang_port_t * p = ctx;
+
+    p->result = result ? 1 : 0;
+    fclose (p->out);
+    _spitool_gang_report (p, bp_stats_now () - p->start, p->log, p->length);
+    free (p->log);
+}
+
+/* Expands the comma separated list of ports and glob patterns, skipping
+   ports given twice */
+static int _spitool_gang_ports (const char * list, glob_t * g) {
+    char * copy, * pattern, * save;
+    int flags = 0, result = 0;
+    size_t i, j, count;
+
+    memset (g, 0, sizeof (glob_t));
+    if (!(copy = strdup (list)))
+        return 1;
+    for (pattern = strtok_r (copy, ",", &save); pattern && !result;
+         pattern = strtok_r (NULL, ",", &save)) {
+        count = g->gl_pathc;
+        switch (glob (pattern, flags, NULL, g)) {
+        case 0: break;
+        case GLOB_NOMATCH: fprintf (stderr, "No port matches %s.\n", pattern); result = 1; break;
+        default: fprintf (stderr, "Can't expand %s.\n", pattern); result = 1; break;
+        }
+        flags = GLOB_APPEND;
+        for (i=count; !result && i<g->gl_pathc; i++)
+            for (j=0; j<i; j++)
+                if (!strcmp (g->gl_pathv[i], g->gl_pathv[j])) {
+                    free (g->gl_pathv[i]);
+                    memmove (g->gl_pathv+i, g->gl_pathv+i+1, (g->gl_pathc-i) * sizeof (char *));
+                    g->gl_pathc--;
+                    i--;
+                    break;
+                }
+    }
+    free (copy);
+    if (!result && g->gl_pathc > SPITOOLGANGMAX) {
+        fprintf (stderr, "At most %d ports can run in a gang.\n", SPITOOLGANGMAX);
+        result = 1;
+    }
+    return result;
+}
+
+/* Runs job on every port at once and returns the number of ports that
+   failed, -1 if none could be started */
+int spitool_gang (const char * ports, spitool_gang_job_t job, void * ctx, int verbose) {
+    spitool_gang_port_t * p = NULL;
+    bp_loop_t * loop = NULL;
+    glob_t g;
+    int i, started, failed = -1;
+
+    if (_spitool_gang_ports (ports, &g) ||
+        !(p = calloc (g.gl_pathc, sizeof (spitool_gang_port_t))) ||
+        !(loop = bp_loop_new ()))
+        goto out;
+
+    printf ("Running on %d ports.\n", (int) g.gl_pathc);
+    fflush (stdout);
+    for (started=0; started<g.gl_pathc; started++) {
+        p[started].port = g.gl_pathv[started];
+        p[started].job = job;
+        p[started].ctx = ctx;
+        p[started].verbose = verbose;
+        p[started].result = 1;
+        p[started].start = bp_stats_now ();
+        if (!(p[started].out = open_memstream (&p[started].log, &p[started].length)))
+            break;
+        if (bp_loop_add (loop, _spitool_gang_session, _spitool_gang_done, &p[started])) {
+            fclose (p[started].out);
+            free (p[started].log);
+            break;
+        }
+    }
+    if (started < g.gl_pathc)
+        fprintf (stderr, "Can't start a session for %s.\n", p[started].port);
+    if (!started)
+        goto out;
+    if (bp_loop_run (loop))
+        fprintf (stderr, "The event loop failed.\n");
+
+    failed = 0;
+    for (i=0; i<started; i++)
+        failed += p[i].result;
+    failed += g.gl_pathc - started;
+    printf ("%d of %d ports succeeded.\n", (int) g.gl_pathc - failed, (int) g.gl_pathc);
+
+out:
+    bp_loop_free (loop);
+    free (p);
+    globfree (&g);
+    return failed;
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_GANG_H__
+#define __SPITOOL_GANG_H__
+
+#include <stdio.h>
+
+#define SPITOOLGANGMAX 64     // Ports of a gang
+
+/* Runs the command on one port of the gang, with its messages going to
+   log, and returns its result */
+typedef int (*spitool_gang_job_t) (void * ctx, const char * port, FILE * log);
+
+int spitool_gang (const char * ports, spitool_gang_job_t job, void * ctx, int verbose);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Erase/program planner for flash updates.
+ *
+ * Every page is classified as unchanged, programmable (only 1->0 bit
+ * transitions) or in need of an erase. Going up the erase hierarchy
+ * (sector, 32k block, 64k block, chip), each unit is either erased as a
+ * whole and all its non-empty pages programmed, or left to the cheapest
+ * plans of its parts. The cheaper alternative, by the device's erase
+ * times and the cost of programming a page, wins.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "spitool_plan.h"
+
+#define PLANMAXLEVELS 4
+#define PLANINFINITE (LONG_MAX/4)
+
+enum PLANPAGESTATES {
+    PPSKIP,
+    PPPROGRAM,
+    PPERASE
+};
+
+typedef struct plan_level_s {
+    uint32_t size;
+    int time;
+    int op;
+    int first;                // Index of the first unit touching the range
+    int count;
+    long * best;              // Cheapest cost per unit
+    long * erased;            // Cost to program the unit after erasing it, without the erase
+    char * erase;             // Unit is erased as a whole in the cheapest plan
+} plan_level_t;
+
+typedef struct plan_ctx_s {
+    const bp_device_t * device;
+    uint32_t start;
+    int length;
+    int pagecost;
+    const uint8_t * old;
+    const uint8_t * new;
+    plan_level_t level [PLANMAXLEVELS];
+    int levels;
+    spitool_plan_t * plan;
+} plan_ctx_t;
+
+static int plan_add (spitool_plan_t * plan, int op, uint32_t addr, int length) {
+    spitool_plan_op_t * ops;
+
+    if (plan->count == plan->size) {
+        if (!(ops = realloc (plan->ops, (plan->size ? 2*plan->size : 64) * sizeof (spitool_plan_op_t))))
+            return 1;
+        plan->ops = ops;
+        plan->size = plan->size ? 2*plan->size : 64;
+    }
+    plan->ops[plan->count].op = op;
+    plan->ops[plan->count].addr = addr;
+    plan->ops[plan->count].length = length;
+    plan->count++;
+    if (op == SPOPROGRAM)
+        plan->programs++;
+    else
+        plan->erases++;
+    return 0;
+}
+
+/* Returns the state of the page at addr and the span that needs programming */
+static int plan_page (plan_ctx_t * ctx, uint32_t addr, int * from, int * to) {
+    int i, state = PPSKIP;
+    int pagesize = ctx->device->pagesize;
+    const uint8_t * old = ctx->old ? ctx->old + addr - ctx->start : NULL;
+    const uint8_t * new = ctx->new + addr - ctx->start;
+
+    *from = pagesize;
+    *to = -1;
+    for (i=0; i<pagesize; i++) {
+        if (old && old[i] == new[i])
+            continue;
+        if (!old || (~old[i] & new[i]))
+            state = PPERASE;
+        else if (state == PPSKIP)
+            state = PPPROGRAM;
+        if (*from == pagesize)
+            *from = i;
+        *to = i;
+    }
+    return state;
+}
+
+/* Span of the page at addr that isn't 0xff, -1 if the page stays erased */
+static int plan_page_erased (plan_ctx_t * ctx, uint32_t addr, int * from, int * to) {
+    int i;
+    const uint8_t * new = ctx->new + addr - ctx->start;
+
+    for (i=0; i<ctx->device->pagesize && new[i] == 0xff; i++) ;
+    if (i == ctx->device->pagesize)
+        return -1;
+    *from = i;
+    for (i=ctx->device->pagesize-1; new[i] == 0xff; i--) ;
+    *to = i;
+    return 0;
+}
+
+static int plan_contained (plan_ctx_t * ctx, uint32_t addr, uint32_t size) {
+    return addr >= ctx->start && addr + size <= ctx->start + ctx->length;
+}
+
+static void plan_sectors (plan_ctx_t * ctx) {
+    plan_level_t * l = &ctx->level[0];
+    int u, from, to, state;
+    uint32_t addr;
+    long keep, erased;
+
+    for (u=0; u<l->count; u++) {
+        keep = erased = 0;
+        for (addr=(l->first+u)*l->size; addr<(l->first+u+1)*l->size; addr+=ctx->device->pagesize) {
+            state = plan_page (ctx, addr, &from, &to);
+            if (state == PPERASE)
+                keep = PLANINFINITE;
+            else if (state == PPPROGRAM && keep < PLANINFINITE)
+                keep += ctx->pagecost;
+            if (!plan_page_erased (ctx, addr, &from, &to))
+                erased += ctx->pagecost;
+        }
+        l->erased[u] = erased;
+        l->erase[u] = keep >= l->time + erased;
+        l->best[u] = l->erase[u] ? l->time + erased : keep;
+    }
+}
+
+static void plan_blocks (plan_ctx_t * ctx, int level) {
+    plan_level_t * l = &ctx->level[level], * c = &ctx->level[level-1];
+    int u, child, ratio = l->size / c->size;
+    long keep, erased;
+
+    for (u=0; u<l->count; u++) {
+        keep = erased = 0;
+        for (child=(l->first+u)*ratio; child<(l->first+u+1)*ratio; child++) {
+            if (child < c->first || child >= c->first + c->count)
+                continue;
+            keep += c->best[child - c->first];
+            erased += c->erased[child - c->first];
+        }
+        l->erased[u] = erased;
+        l->erase[u] = plan_contained (ctx, (l->first+u)*l->size, l->size) &&
+                      keep > l->time + erased;
+        l->best[u] = l->erase[u] ? l->time + erased : keep;
+    }
+}
+
+static int plan_emit (plan_ctx_t * ctx, int level, int unit) {
+    plan_level_t * l = &ctx->level[level];
+    uint32_t addr = unit * l->size;
+    int child, ratio, from, to;
+
+    if (l->erase[unit - l->first]) {
+        if (plan_add (ctx->plan, l->op, addr, l->size))
+            return 1;
+        for (; addr<(unit+1)*l->size; addr+=ctx->device->pagesize)
+            if (!plan_page_erased (ctx, addr, &from, &to) &&
+                plan_add (ctx->plan, SPOPROGRAM, addr+from, to-from+1))
+                return 1;
+        return 0;
+    }
+
+    if (!level) {
+        for (; addr<(unit+1)*l->size; addr+=ctx->device->pagesize)
+            if (plan_page (ctx, addr, &from, &to) == PPPROGRAM &&
+                plan_add (ctx->plan, SPOPROGRAM, addr+from, to-from+1))
+                return 1;
+        return 0;
+    }
+
+    ratio = l->size / ctx->level[level-1].size;
+    for (child=unit*ratio; child<(unit+1)*ratio; child++)
+        if (child >= ctx->level[level-1].first &&
+            child < ctx->level[level-1].first + ctx->level[level-1].count &&
+            plan_emit (ctx, level-1, child))
+            return 1;
+    return 0;
+}
+
+static void plan_add_level (plan_ctx_t * ctx, uint32_t size, int time, int op) {
+    plan_level_t * l = &ctx->level[ctx->levels];
+
+    if (ctx->levels && (time <= 0 || size <= l[-1].size || size % l[-1].size ||
+                        size > ctx->device->capacity))
+        return;
+    l->size = size;
+    l->time = time > 0 ? time : 1;
+    l->op = op;
+    l->first = ctx->start / size;
+    l->count = (ctx->start + ctx->length - 1) / size - l->first + 1;
+    ctx->levels++;
+}
+
+/* Plans the erase and program operations to turn old into new in the
+   sector aligned range [start, start+length). old may be NULL for unknown
+   content. pagecost is the time to program a page in us. */
+int spitool_plan_flash (const bp_device_t * device, int pagecost, uint32_t start, int length,
+                        const uint8_t * old, const uint8_t * new, spitool_plan_t * plan) {
+    plan_ctx_t ctx;
+    int i, u, result = 0;
+
+    memset (plan, 0, sizeof (spitool_plan_t));
+    if (device->sectorsize <= 0 || device->pagesize <= 0 ||
+        device->sectorsize % device->pagesize ||
+        start % device->sectorsize || length <= 0 || length % device->sectorsize)
+        return 1;
+
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.device = device;
+    ctx.start = start;
+    ctx.length = length;
+    ctx.pagecost = pagecost;
+    ctx.old = old;
+    ctx.new = new;
+    ctx.plan = plan;
+
+    plan_add_level (&ctx, device->sectorsize, device->tse, SPOERASESECTOR);
+    plan_add_level (&ctx, 32768, device->tbe32, SPOERASEBLOCK32);
+    plan_add_level (&ctx, 65536, device->tbe64, SPOERASEBLOCK64);
+    if (start == 0 && length == device->capacity)
+        plan_add_level (&ctx, device->capacity, device->tce, SPOERASECHIP);
+
+    for (i=0; i<ctx.levels; i++) {
+        ctx.level[i].best = malloc (ctx.level[i].count * sizeof (long));
+        ctx.level[i].erased = malloc (ctx.level[i].count * sizeof (long));
+        ctx.level[i].erase = malloc (ctx.level[i].count);
+        if (!ctx.level[i].best || !ctx.level[i].erased || !ctx.level[i].erase)
+            result = 1;
+    }
+
+    if (!result) {
+        plan_sectors (&ctx);
+        for (i=1; i<ctx.levels; i++)
+            plan_blocks (&ctx, i);
+        for (u=0; u<ctx.level[ctx.levels-1].count; u++) {
+            plan->cost += ctx.level[ctx.levels-1].best[u];
+            if ((result = plan_emit (&ctx, ctx.levels-1, ctx.level[ctx.levels-1].first+u)))
+                break;
+        }
+    }
+
+    for (i=0; i<ctx.levels; i++) {
+        free (ctx.level[i].best);
+        free (ctx.level[i].erased);
+        free (ctx.level[i].erase);
+    }
+    if (result)
+        spitool_plan_free (plan);
+    return result;
+}
+
+void spitool_plan_free (spitool_plan_t * plan) {
+    free (plan->ops);
+    memset (plan, 0, sizeof (spitool_plan_t));
+}
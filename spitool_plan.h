@@ -0,0 +1,53 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_PLAN_H__
+#define __SPITOOL_PLAN_H__
+
+#include <inttypes.h>
+#include "buspirate.h"
+
+enum SPITOOLPLANOPS {
+    SPOERASESECTOR,
+    SPOERASEBLOCK32,
+    SPOERASEBLOCK64,
+    SPOERASECHIP,
+    SPOPROGRAM
+};
+
+typedef struct spitool_plan_op_s {
+    int op;
+    uint32_t addr;
+    int length;
+} spitool_plan_op_t;
+
+typedef struct spitool_plan_s {
+    spitool_plan_op_t * ops;
+    int count;
+    int size;
+    long cost;                // Estimated time in us
+    int erases;
+    int programs;
+} spitool_plan_t;
+
+int spitool_plan_flash (const bp_device_t * device, int pagecost, uint32_t start, int length,
+                        const uint8_t * old, const uint8_t * new, spitool_plan_t * plan);
+void spitool_plan_free (spitool_plan_t * plan);
+
+#endif
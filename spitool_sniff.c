@@ -0,0 +1,416 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Sniffer capture. The main thread only drains the port, in reads as
+ * large as the port has data for, into a lock-free ring. A decoder thread
+ * takes the chunks from there, writes them to the capture file or parses
+ * them, so a slow terminal or disk never holds up the port.
+ *
+ * The sniffer frames its output: '[' and ']' for CS going low and high,
+ * '\' followed by MOSI and MISO for each byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spitool_sniff.h"
+#include "serial.h"
+#include "bpstats.h"
+
+#define SPITOOLSNIFFRING (16 << 20) // Ring between capture and decoder, a power of two
+#define SPITOOLSNIFFCHUNK 65536     // Largest read from the port at once
+
+enum SPITOOLSNIFFSTATES {
+    SSSFRAME,                 // Expecting a marker
+    SSSMOSI,
+    SSSMISO
+};
+
+/* Precedes each chunk in the ring */
+typedef struct spitool_sniff_chunk_s {
+    uint32_t length;
+    uint32_t dropped;         // Bytes lost to a full ring right before this chunk
+    int64_t time;
+} spitool_sniff_chunk_t;
+
+/* Single producer, single consumer */
+typedef struct spitool_sniff_ring_s {
+    uint8_t * data;
+    atomic_size_t head;       // Free running, written by the capture only
+    atomic_size_t tail;       // Free running, written by the decoder only
+    atomic_int done;
+} spitool_sniff_ring_t;
+
+typedef struct spitool_sniff_decoder_s {
+    spitool_sniff_ring_t * ring;
+    FILE * capture;
+    spitool_sniff_parser_t parser;
+    int64_t lasttime;
+    int result;
+} spitool_sniff_decoder_t;
+
+void spitool_sniff_parser_init (spitool_sniff_parser_t * parser, const spitool_sniff_sink_t * sink) {
+    memset (parser, 0, sizeof (spitool_sniff_parser_t));
+    parser->sink = sink;
+}
+
+void spitool_sniff_parse (spitool_sniff_parser_t * parser, const uint8_t * data, size_t length) {
+    const spitool_sniff_sink_t * sink = parser->sink;
+    uint8_t split [3] = { '\\' };
+    size_t i, j;
+
+    for (i=0; i<length; i++) {
+        switch (parser->state) {
+        case SSSFRAME:
+            switch (data[i]) {
+            case '[':
+            case ']':
+                parser->frames += data[i] == '[';
+                if (sink->cs)
+                    sink->cs (sink->ctx, data[i] == '[', parser->time);
+                break;
+            case '\\':
+                /* Most of the output is whole bytes, handed on in runs */
+                for (j=i; j+2<length && data[j] == '\\'; j+=3) ;
+                if (j > i) {
+                    parser->bytes += (j - i) / 3;
+                    if (sink->bytes)
+                        sink->bytes (sink->ctx, data + i, (j - i) / 3);
+                    i = j - 1;
+                } else {
+                    parser->state = SSSMOSI;
+                }
+                break;
+            default:
+                parser->junk++;
+            }
+            break;
+        case SSSMOSI:
+            parser->mosi = data[i];
+            parser->state = SSSMISO;
+            break;
+        case SSSMISO:
+            /* A byte split between two chunks */
+            split[1] = parser->mosi;
+            split[2] = data[i];
+            parser->bytes++;
+            if (sink->bytes)
+                sink->bytes (sink->ctx, split, 1);
+            parser->state = SSSFRAME;
+            break;
+        }
+    }
+}
+
+/* Whatever was lost, the next byte is taken for a marker again */
+void spitool_sniff_dropped (spitool_sniff_parser_t * parser, unsigned long bytes) {
+    parser->state = SSSFRAME;
+    if (parser->sink->drop)
+        parser->sink->drop (parser->sink->ctx, bytes, parser->time);
+}
+
+static int _spitool_sniff_push (spitool_sniff_ring_t * ring, const spitool_sniff_chunk_t * chunk,
+                                const uint8_t * data) {
+    size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+    size_t at, l, n;
+
+    if (SPITOOLSNIFFRING - (head - tail) < sizeof (spitool_sniff_chunk_t) + chunk->length)
+        return 1;
+    for (n=0; n<sizeof (spitool_sniff_chunk_t) + chunk->length; n+=l) {
+        const uint8_t * from = n < sizeof (spitool_sniff_chunk_t) ?
+                               (const uint8_t *) chunk + n : data + n - sizeof (spitool_sniff_chunk_t);
+
+        at = (head + n) & (SPITOOLSNIFFRING-1);
+        l = n < sizeof (spitool_sniff_chunk_t) ? sizeof (spitool_sniff_chunk_t) - n :
+                                                 sizeof (spitool_sniff_chunk_t) + chunk->length - n;
+        if (l > SPITOOLSNIFFRING - at)
+            l = SPITOOLSNIFFRING - at;
+        memcpy (ring->data + at, from, l);
+    }
+    atomic_store_explicit (&ring->head, head + n, memory_order_release);
+    return 0;
+}
+
+/* Hands out the bytes at the tail, as much as is contiguous */
+static size_t _spitool_sniff_peek (spitool_sniff_ring_t * ring, size_t tail, size_t length, uint8_t ** data) {
+    size_t at = tail & (SPITOOLSNIFFRING-1);
+
+    *data = ring->data + at;
+    return length < SPITOOLSNIFFRING - at ? length : SPITOOLSNIFFRING - at;
+}
+
+static void _spitool_sniff_varint (FILE * file, uint64_t value) {
+    do {
+        fputc ((value & 0x7f) | (value > 0x7f ? 0x80 : 0), file);
+        value >>= 7;
+    } while (value);
+}
+
+static void _spitool_sniff_chunk (spitool_sniff_decoder_t * decoder, const spitool_sniff_chunk_t * chunk,
+                                  size_t tail) {
+    uint8_t * data;
+    size_t n, l;
+
+    decoder->parser.time = chunk->time;
+    if (chunk->dropped) {
+        if (decoder->capture) {
+            fputc (SSRDROP, decoder->capture);
+            _spitool_sniff_varint (decoder->capture, chunk->time - decoder->lasttime);
+            _spitool_sniff_varint (decoder->capture, chunk->dropped);
+            decoder->lasttime = chunk->time;
+        }
+        spitool_sniff_dropped (&decoder->parser, chunk->dropped);
+    }
+    if (!chunk->length)
+        return;
+    if (decoder->capture) {
+        fputc (SSRDATA, decoder->capture);
+        _spitool_sniff_varint (decoder->capture, chunk->time - decoder->lasttime);
+        _spitool_sniff_varint (decoder->capture, chunk->length);
+        decoder->lasttime = chunk->time;
+    }
+    for (n=0; n<chunk->length; n+=l) {
+        l = _spitool_sniff_peek (decoder->ring, tail + n, chunk->length - n, &data);
+        if (decoder->capture && fwrite (data, l, 1, decoder->capture) != 1)
+            decoder->result = 1;
+        spitool_sniff_parse (&decoder->parser, data, l);
+    }
+}
+
+static void * _spitool_sniff_decoder (void * arg) {
+    spitool_sniff_decoder_t * decoder = arg;
+    spitool_sniff_ring_t * ring = decoder->ring;
+    spitool_sniff_chunk_t chunk;
+    size_t head, tail = 0, n, l;
+    uint8_t * data;
+    int done;
+
+    while (1) {
+        /* done is read first, so nothing pushed before it was set is missed */
+        done = atomic_load_explicit (&ring->done, memory_order_acquire);
+        head = atomic_load_explicit (&ring->head, memory_order_acquire);
+        if (head == tail) {
+            if (done)
+                break;
+            /* Output is flushed while the ring is idle, not per line */
+            if (decoder->capture)
+                fflush (decoder->capture);
+            fflush (stdout);
+            usleep (1000);
+            continue;
+        }
+        for (n=0; n<sizeof (chunk); n+=l) {
+            l = _spitool_sniff_peek (ring, tail + n, sizeof (chunk) - n, &data);
+            memcpy ((uint8_t *) &chunk + n, data, l);
+        }
+        _spitool_sniff_chunk (decoder, &chunk, tail + sizeof (chunk));
+        tail += sizeof (chunk) + chunk.length;
+        atomic_store_explicit (&ring->tail, tail, memory_order_release);
+    }
+    if (decoder->capture && fflush (decoder->capture))
+        decoder->result = 1;
+    fflush (stdout);
+    return NULL;
+}
+
+/* Puts the bus pirate into sniff mode and captures until a key is pressed.
+   The raw output goes to capture and sink, where given. */
+int spitool_sniff_capture (bp_state_t * bp, uint8_t mode, FILE * capture,
+                           const spitool_sniff_sink_t * sink, FILE * msg) {
+    static const spitool_sniff_sink_t nosink = { NULL };
+    spitool_sniff_ring_t ring;
+    spitool_sniff_decoder_t decoder;
+    spitool_sniff_chunk_t chunk;
+    struct termios orig, raw;
+    struct pollfd fds [2];
+    pthread_t thread;
+    uint8_t * buffer;
+    unsigned long long total = 0, dropped = 0;
+    unsigned long overflows = 0, pending = 0;
+    long start;
+    int result = 0, n, tty;
+
+    memset (&ring, 0, sizeof (ring));
+    if (!(ring.data = malloc (SPITOOLSNIFFRING)) || !(buffer = malloc (SPITOOLSNIFFCHUNK))) {
+        free (ring.data);
+        return 1;
+    }
+    memset (&decoder, 0, sizeof (decoder));
+    decoder.ring = &ring;
+    decoder.capture = capture;
+    spitool_sniff_parser_init (&decoder.parser, sink ? sink : &nosink);
+
+    serWriteChar (bp->fd, mode);
+    if (serReadCharTimed (bp->fd, 10000) != 1) {
+        fprintf (msg, "Sniffer didn't start.\n");
+        free (buffer);
+        free (ring.data);
+        return 1;
+    }
+    if (capture) {
+        fputs (SPITOOLSNIFFMAGIC, capture);
+        fputc (SPITOOLSNIFFVERSION, capture);
+        fputc (mode, capture);
+    }
+
+    fds[0].fd = bp->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if ((tty = !tcgetattr (STDIN_FILENO, &orig))) {
+        raw = orig;
+        raw.c_lflag &= ~(ECHO | ICANON);
+        tcsetattr (STDIN_FILENO, TCSANOW, &raw);
+    }
+    fprintf (msg, "Sniffing started, press any key to abort\n");
+    fflush (msg);
+    if (pthread_create (&thread, NULL, _spitool_sniff_decoder, &decoder)) {
+        result = 1;
+        goto out;
+    }
+
+    start = bp_stats_now ();
+    while (1) {
+        /* Data already read ahead into the port buffer won't wake up poll */
+        if (poll (fds, 2, serAvailable (bp->fd) ? 0 : 100) == -1 && errno != EINTR) {
+            perror ("poll");
+            result = 1;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if ((n = serReadSome (bp->fd, 0, SPITOOLSNIFFCHUNK, buffer)) == -1) {
+            result = 1;
+            break;
+        }
+        if (!n)
+            continue;
+        chunk.length = n;
+        chunk.dropped = pending;
+        chunk.time = bp_stats_now () - start;
+        total += n;
+        if (_spitool_sniff_push (&ring, &chunk, buffer)) {
+            /* The decoder learns about the gap with the next chunk that fits */
+            overflows += !pending;
+            pending += n;
+            dropped += n;
+        } else {
+            pending = 0;
+        }
+    }
+    chunk.length = 0;
+    chunk.dropped = pending;
+    chunk.time = bp_stats_now () - start;
+    while (pending && _spitool_sniff_push (&ring, &chunk, NULL))
+        usleep (1000);
+
+    atomic_store_explicit (&ring.done, 1, memory_order_release);
+    pthread_join (thread, NULL);
+    result |= decoder.result;
+
+out:
+    /* Any byte ends sniffing */
+    serWriteChar (bp->fd, 0);
+    serFlush (bp->fd);
+    if (tty) {
+        if (fds[1].revents)
+            getchar ();
+        tcsetattr (STDIN_FILENO, TCSANOW, &orig);
+    }
+    fprintf (msg, "Captured %llu bytes, %llu bytes dropped in %lu overflows.\n", total, dropped, overflows);
+    if (sink)
+        fprintf (msg, "%llu frames, %llu SPI bytes, %llu bytes outside of frames.\n",
+                 decoder.parser.frames, decoder.parser.bytes, decoder.parser.junk);
+    free (buffer);
+    free (ring.data);
+    return result;
+}
+
+static int _spitool_sniff_getvarint (const uint8_t ** at, const uint8_t * end, uint64_t * value) {
+    int shift;
+
+    *value = 0;
+    for (shift=0; *at<end && shift<64; shift+=7) {
+        *value |= (uint64_t) (**at & 0x7f) << shift;
+        if (!(*(*at)++ & 0x80))
+            return 0;
+    }
+    return 1;
+}
+
+/* Feeds a capture file written by sniff -f to parser, as fast as it parses.
+   The file is mapped, so the records are parsed where they are. */
+int spitool_sniff_replay (const char * filename, spitool_sniff_parser_t * parser, FILE * msg) {
+    const uint8_t * map, * at, * end;
+    uint64_t delta, length;
+    struct stat st;
+    int fd, result = 0;
+    uint8_t type;
+
+    if ((fd = open (filename, O_RDONLY)) == -1 || fstat (fd, &st)) {
+        perror (filename);
+        if (fd != -1)
+            close (fd);
+        return 1;
+    }
+    if (st.st_size < 6 ||
+        (map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf (msg, "%s is no sniff capture.\n", filename);
+        close (fd);
+        return 1;
+    }
+    close (fd);
+    madvise ((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    end = map + st.st_size;
+    if (memcmp (map, SPITOOLSNIFFMAGIC, 4) || map[4] != SPITOOLSNIFFVERSION) {
+        fprintf (msg, "%s is no sniff capture of version %d.\n", filename, SPITOOLSNIFFVERSION);
+        result = 1;
+    }
+    for (at=map+6; !result && at<end; ) {
+        type = *at++;
+        if (_spitool_sniff_getvarint (&at, end, &delta) || _spitool_sniff_getvarint (&at, end, &length) ||
+            type > SSRDROP || (type == SSRDATA && length > end - at)) {
+            fprintf (msg, "%s is damaged at offset %ld.\n", filename, (long) (at - map));
+            result = 1;
+            break;
+        }
+        parser->time += delta;
+        if (type == SSRDROP) {
+            spitool_sniff_dropped (parser, length);
+        } else {
+            spitool_sniff_parse (parser, at, length);
+            at += length;
+        }
+    }
+    munmap ((void *) map, st.st_size);
+    return result;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the spitool project.
+ *
+ * Copyright (C) 2012 Christian Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SPITOOL_SNIFF_H__
+#define __SPITOOL_SNIFF_H__
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "buspirate.h"
+
+#define SPITOOLSNIFFMAGIC "SPSN"
+#define SPITOOLSNIFFVERSION 1
+
+/* Capture file records, after the magic, the version and the sniff mode */
+enum SPITOOLSNIFFRECORDS {
+    SSRDATA,                  // time delta, length, raw sniffer output
+    SSRDROP                   // time delta, bytes lost to a full ring
+};
+
+/* What the framed sniffer output means, times in us since the start.
+   bytes gets runs of count bytes as sniffed: '\\', MOSI, MISO each. */
+typedef struct spitool_sniff_sink_s {
+    void (*cs) (void * ctx, int low, long time);
+    void (*bytes) (void * ctx, const uint8_t * run, size_t count);
+    void (*drop) (void * ctx, unsigned long bytes, long time);
+    void * ctx;
+} spitool_sniff_sink_t;
+
+typedef struct spitool_sniff_parser_s {
+    const spitool_sniff_sink_t * sink;
+    int state;
+    uint8_t mosi;
+    long time;                // Of the chunk being parsed
+    unsigned long long bytes; // SPI bytes seen
+    unsigned long long frames;
+    unsigned long long junk;  // Sniffer output outside of any marker
+} spitool_sniff_parser_t;
+
+void spitool_sniff_parser_init (spitool_sniff_parser_t * parser, const spitool_sniff_sink_t * sink);
+void spitool_sniff_parse (spitool_sniff_parser_t * parser, const uint8_t * data, size_t length);
+void spitool_sniff_dropped (spitool_sniff_parser_t * parser, unsigned long bytes);
+
+int spitool_sniff_capture (bp_state_t * bp, uint8_t mode, FILE * capture,
+                           const spitool_sniff_sink_t * sink, FILE * msg);
+int spitool_sniff_replay (const char * filename, spitool_sniff_parser_t * parser, FILE * msg);
+
+#endif